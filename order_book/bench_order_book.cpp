@@ -0,0 +1,360 @@
+/*
+Compile with
+g20 -O2 -pthread order_book.cpp bench_order_book.cpp -o ../bin/bench_order_book
+
+Mass cancel: a book with 100K resting bids from 100 traders over 200 price
+levels is emptied once per method, one cancelOrder per id (the baseline),
+one cancelTraderOrders per trader, one cancelPriceRange per 10 levels and a
+single cancelSide. Only the cancels are timed.
+
+Matching: an order that takes half of a level of N orders of 10 lots each,
+for FIFO, pro-rata and top order books. Only that order is timed.
+
+Replay: 1M events over 2000 symbols replayed on 0 (the calling thread), 1,
+2, 4 and 8 workers, including the partition and the merge. The speedup over
+0 workers is bounded by hardware_concurrency, which is printed with it.
+
+Capture: the same events written to a capture (mean and worst time of an
+append on the calling thread, bytes per event against a raw BookEvent), then
+read back whole and for 1% of the day.
+
+Replication: 50K commands on one book, applied to a plain OrderBook and to
+a PrimaryBook whose backup runs on another thread, in ASYNC (batches of 64)
+and SYNC mode over a socketpair and loopback TCP. Prints the cost per command
+on the primary and the largest lag (commands not acked yet) seen after a
+command.
+
+Checksum: comparing a book of 100K resting orders with a replica, by
+getChecksum (kept up to date) and by computeChecksum (from scratch).
+
+Queue position: getQueuePosition for every order at a level of 10K orders,
+every 100th of which is ours (watched) and the rest not, so looked up by
+walking the level. One JSON object per line.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "capture.h"
+#include "order_book.h"
+#include "replay.h"
+#include "replication.h"
+
+namespace ns = std::chrono;
+
+constexpr int NUM_ORDERS = 100000;
+constexpr int NUM_TRADERS = 100;
+constexpr int NUM_LEVELS = 200;
+constexpr int NUM_RUNS = 5;
+
+// Fills a book and returns the ids of the resting orders, ascending. Every
+// other order is cancelled again, as in a book that has been trading for a
+// while, so the orders are not laid out in memory in the order of their ids.
+std::vector<int> fillBook(OrderBook& book) {
+    std::vector<int> ids;
+    for (int i = 0; i < 2 * NUM_ORDERS; ++i) {
+        int price = 100 + (i * 7919) % NUM_LEVELS;
+        ids.push_back(
+            book.addOrder(price, 10, true, -1, i % NUM_TRADERS).second);
+        if (i % 2 == 1) {
+            // a fixed pseudo-random pick, so that every run is the same
+            size_t victim = (uint64_t{1} * i * 104729) % ids.size();
+            book.cancelOrder(ids[victim]);
+            ids[victim] = ids.back();
+            ids.pop_back();
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+using CancelFn = std::function<int(OrderBook&, const std::vector<int>&)>;
+
+void benchMassCancel(const std::string& method, const CancelFn& cancel) {
+    // the best of a few runs, each on a fresh book
+    double seconds = 1e9;
+    int numCancelled = 0;
+    bool empty = true;
+    for (int run = 0; run < NUM_RUNS; ++run) {
+        OrderBook book(1000, 1);
+        auto ids = fillBook(book);
+        auto t0 = ns::steady_clock::now();
+        numCancelled = cancel(book, ids);
+        seconds = std::min(
+            seconds,
+            ns::duration<double>(ns::steady_clock::now() - t0).count());
+        empty = empty && book.getL1OrderData().bestBid.price == -1;
+    }
+    std::cout << "{\"bench\":\"mass_cancel\",\"method\":\"" << method
+              << "\",\"orders\":" << numCancelled << ",\"book_empty\":"
+              << (empty ? "true" : "false")
+              << ",\"ms\":" << seconds * 1e3
+              << ",\"ns_per_order\":" << seconds * 1e9 / numCancelled << "}"
+              << std::endl;
+}
+
+template <typename Book>
+void benchMatching(const std::string& policy, int levelOrders) {
+    constexpr int NUM_REPS = 200;
+    double seconds = 0;
+    for (int rep = 0; rep < NUM_REPS; ++rep) {
+        Book book(1000, 1);
+        for (int i = 0; i < levelOrders; ++i) {
+            book.addOrder(100, 10, true);
+        }
+        auto t0 = ns::steady_clock::now();
+        book.addOrder(100, levelOrders * 5, false);
+        seconds += ns::duration<double>(ns::steady_clock::now() - t0).count();
+    }
+    std::cout << "{\"bench\":\"matching\",\"policy\":\"" << policy
+              << "\",\"level_orders\":" << levelOrders
+              << ",\"ns_per_match\":" << seconds * 1e9 / NUM_REPS
+              << ",\"ns_per_level_order\":"
+              << seconds * 1e9 / NUM_REPS / levelOrders << "}" << std::endl;
+}
+
+constexpr int NUM_EVENTS = 1000000;
+
+// numEvents over numSymbols, as a market data feed would see them
+std::vector<BookEvent> makeEvents(int numEvents = NUM_EVENTS,
+                                  int numSymbols = 2000) {
+    std::vector<BookEvent> events;
+    std::vector<int> numAdds(numSymbols, 0);
+    uint32_t rand = 12345;
+    for (int i = 0; i < numEvents; ++i) {
+        rand = rand * 1103515245 + 12345;
+        BookEvent e;
+        e.timestamp = i;
+        e.symbol = rand % numSymbols;
+        e.price = 95 + (rand >> 20) % 10;
+        e.size = 1 + (rand >> 24) % 10;
+        if (numAdds[e.symbol] > 0 && (rand >> 8) % 4 == 0) {
+            e.type = EventType::CANCEL;
+            e.orderId = 1 + (rand >> 14) % numAdds[e.symbol];
+        } else {
+            e.isBid = (rand >> 16) % 2;
+            ++numAdds[e.symbol];
+        }
+        events.push_back(e);
+    }
+    return events;
+}
+
+void benchReplay(const std::vector<BookEvent>& events) {
+    double serialSeconds = 0;
+    for (size_t workers : {0, 1, 2, 4, 8}) {
+        auto t0 = ns::steady_clock::now();
+        auto outputs = replay(events, {1000, 1, workers});
+        double seconds =
+            ns::duration<double>(ns::steady_clock::now() - t0).count();
+        if (workers == 0) {
+            serialSeconds = seconds;
+        }
+        std::cout << "{\"bench\":\"replay\",\"workers\":" << workers
+                  << ",\"cores\":" << std::thread::hardware_concurrency()
+                  << ",\"events\":" << NUM_EVENTS
+                  << ",\"outputs\":" << outputs.size()
+                  << ",\"ms\":" << seconds * 1e3
+                  << ",\"speedup\":" << serialSeconds / seconds << "}"
+                  << std::endl;
+    }
+}
+
+void benchCapture(const std::vector<BookEvent>& events) {
+    const char* path = "/tmp/bench_order_book.capture";
+    double worst = 0;
+    auto t0 = ns::steady_clock::now();
+    size_t numAllocated = 0;
+    {
+        CaptureWriter writer(path);
+        for (const auto& e : events) {
+            auto t = ns::steady_clock::now();
+            writer.append(e);
+            worst = std::max(
+                worst, ns::duration<double>(ns::steady_clock::now() - t)
+                           .count());
+        }
+        numAllocated = writer.getNumAllocatedBlocks();
+    }
+    double writeSeconds =
+        ns::duration<double>(ns::steady_clock::now() - t0).count();
+    CaptureReader reader(path);
+    uint64_t bytes = 0;
+    for (const auto& b : reader.getBlocks()) {
+        bytes += b.numBytes;
+    }
+    std::cout << "{\"bench\":\"capture_write\",\"events\":"
+              << events.size() << ",\"ns_per_append\":"
+              << writeSeconds * 1e9 / events.size()
+              << ",\"worst_append_us\":" << worst * 1e6
+              << ",\"allocated_blocks\":" << numAllocated
+              << ",\"bytes_per_event\":" << double(bytes) / events.size()
+              << ",\"raw_bytes_per_event\":" << sizeof(BookEvent) << "}"
+              << std::endl;
+
+    int64_t last = events.back().timestamp;
+    for (auto [name, from, to] :
+         {std::tuple{"all", int64_t{0}, last},
+          std::tuple{"one_percent", last / 2, last / 2 + last / 100}}) {
+        std::vector<BookEvent> out;
+        t0 = ns::steady_clock::now();
+        size_t numBlocks = reader.read(from, to, out);
+        double seconds =
+            ns::duration<double>(ns::steady_clock::now() - t0).count();
+        std::cout << "{\"bench\":\"capture_read\",\"range\":\"" << name
+                  << "\",\"events\":" << out.size()
+                  << ",\"blocks_decoded\":" << numBlocks
+                  << ",\"ms\":" << seconds * 1e3 << "}" << std::endl;
+    }
+    std::remove(path);
+}
+
+void benchReplication(const std::string& name, AckMode mode, bool overTcp) {
+    auto commands = makeEvents(50000, 1);
+    int fds[2] = {-1, -1};
+    if (overTcp) {
+        int listenFd = listenLoopback(0);
+        fds[0] = connectLoopback(getBoundPort(listenFd));
+        fds[1] = acceptConnection(listenFd);
+        ::close(listenFd);
+    } else if (!name.empty()) {
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    }
+    auto apply = [&](auto& book) {
+        uint64_t maxLag = 0;
+        for (const auto& e : commands) {
+            if (e.type == EventType::ADD) {
+                book.addOrder(e.price, e.size, e.isBid);
+            } else if (e.type == EventType::CANCEL) {
+                book.cancelOrder(e.orderId);
+            } else {
+                book.updateOrder(e.orderId, e.price, e.size);
+            }
+            if constexpr (std::is_same_v<decltype(book), PrimaryBook&>) {
+                maxLag = std::max(maxLag, book.getLag());
+            }
+        }
+        return maxLag;
+    };
+    double seconds;
+    uint64_t maxLag = 0;
+    auto t0 = ns::steady_clock::now();
+    if (name.empty()) {
+        OrderBook book(1000, 1);
+        apply(book);
+        seconds = ns::duration<double>(ns::steady_clock::now() - t0).count();
+    } else {
+        BackupBook backup(1000, 1, fds[1]);
+        {
+            PrimaryBook primary(1000, 1, fds[0], {mode, 64});
+            t0 = ns::steady_clock::now();
+            maxLag = apply(primary);
+            primary.flush();
+            seconds =
+                ns::duration<double>(ns::steady_clock::now() - t0).count();
+        }
+        backup.promote();
+    }
+    std::cout << "{\"bench\":\"replication\",\"mode\":\""
+              << (name.empty() ? "none" : name)
+              << "\",\"commands\":" << commands.size()
+              << ",\"ns_per_command\":" << seconds * 1e9 / commands.size()
+              << ",\"max_lag\":" << maxLag << "}" << std::endl;
+}
+
+void benchChecksum() {
+    OrderBook book(1000, 1);
+    fillBook(book);
+    for (const char* method : {"incremental", "from_scratch"}) {
+        auto t0 = ns::steady_clock::now();
+        uint64_t sum = method[0] == 'i' ? book.getChecksum()
+                                        : book.computeChecksum();
+        double seconds =
+            ns::duration<double>(ns::steady_clock::now() - t0).count();
+        std::cout << "{\"bench\":\"checksum\",\"method\":\"" << method
+                  << "\",\"orders\":" << NUM_ORDERS
+                  << ",\"matches\":" << (sum == book.computeChecksum()
+                                              ? "true" : "false")
+                  << ",\"us\":" << seconds * 1e6 << "}" << std::endl;
+    }
+}
+
+void benchQueuePosition() {
+    constexpr int LEVEL_ORDERS = 10000;
+    constexpr int US = 1;
+    OrderBook book(1000, 1);
+    book.watchTrader(US);
+    std::vector<int> ours, others;
+    for (int i = 0; i < LEVEL_ORDERS; ++i) {
+        bool isOurs = i % 100 == 0;
+        int id = book.addOrder(100, 10, true, -1, isOurs ? US : 0).second;
+        (isOurs ? ours : others).push_back(id);
+    }
+    for (const auto& [name, ids] : {std::pair{"watched", &ours},
+                                    std::pair{"walked", &others}}) {
+        int64_t sum = 0;  // keeps the lookups from being optimised away
+        auto t0 = ns::steady_clock::now();
+        for (int id : *ids) {
+            sum += book.getQueuePosition(id).second;
+        }
+        double seconds =
+            ns::duration<double>(ns::steady_clock::now() - t0).count();
+        std::cout << "{\"bench\":\"queue_position\",\"method\":\"" << name
+                  << "\",\"level_orders\":" << LEVEL_ORDERS
+                  << ",\"queries\":" << ids->size()
+                  << ",\"mean_ahead\":" << sum / int64_t(ids->size())
+                  << ",\"ns_per_query\":" << seconds * 1e9 / ids->size()
+                  << "}" << std::endl;
+    }
+}
+
+int main() {
+    benchMassCancel("one_by_one", [](OrderBook& book, const auto& ids) {
+        int n = 0;
+        for (int id : ids) {
+            n += book.cancelOrder(id).first;
+        }
+        return n;
+    });
+    benchMassCancel("by_trader", [](OrderBook& book, const auto&) {
+        int n = 0;
+        for (int trader = 0; trader < NUM_TRADERS; ++trader) {
+            n += book.cancelTraderOrders(trader);
+        }
+        return n;
+    });
+    benchMassCancel("by_price_range", [](OrderBook& book, const auto&) {
+        int n = 0;
+        for (int price = 100; price < 100 + NUM_LEVELS; price += 10) {
+            n += book.cancelPriceRange(true, price, price + 9);
+        }
+        return n;
+    });
+    benchMassCancel("side", [](OrderBook& book, const auto&) {
+        return book.cancelSide(true);
+    });
+    for (int levelOrders : {10, 100, 1000}) {
+        benchMatching<OrderBook>("fifo", levelOrders);
+        benchMatching<ProRataOrderBook>("pro_rata", levelOrders);
+        benchMatching<TopOrderOrderBook>("top_order", levelOrders);
+    }
+    auto events = makeEvents();
+    benchReplay(events);
+    benchCapture(events);
+    benchReplication("", AckMode::ASYNC, false);
+    benchReplication("async_unix", AckMode::ASYNC, false);
+    benchReplication("async_tcp", AckMode::ASYNC, true);
+    benchReplication("sync_unix", AckMode::SYNC, false);
+    benchReplication("sync_tcp", AckMode::SYNC, true);
+    benchChecksum();
+    benchQueuePosition();
+}
@@ -0,0 +1,404 @@
+/*
+    A compact capture of book events and L2 snapshots for research, replacing
+   row-oriented text dumps. The file is a sequence of blocks of up to
+   blockEvents events, each stored column by column, since the values within
+   a column look alike and compress far better than whole rows:
+   1) timestamps and prices as zigzag varints of the difference from the
+   previous event (mostly 1 byte, since both move in small steps),
+   2) symbols, order ids and sizes as varints,
+   3) the event type and side packed into one byte.
+   Each column starts with its length in bytes, so a scan of one column can
+   skip over the others. A snapshot is stored as one SNAPSHOT_BID or
+   SNAPSHOT_OFFER row per level, in the same columns.
+
+   After the blocks comes an index with each block's offset and first and
+   last timestamp, then a fixed-size footer pointing at it. CaptureReader
+   maps the file, reads the footer, and binary searches the index for the
+   first block that can hold a timestamp, so reading a time range only
+   decodes the blocks that overlap it.
+
+   The matching thread only appends events to an uncompressed block. A full
+   block is handed to a background thread that encodes and writes it, and
+   the matching thread carries on with a recycled buffer (or a new one, if
+   the compressor is behind), so it never waits for encoding or for the disk.
+   Blocks are written in the order they were filled.
+*/
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "order_book.h"
+#include "replay.h"
+
+struct CaptureBlockInfo {
+    uint64_t offset{0};  // from the start of the file
+    uint32_t numEvents{0};
+    uint32_t numBytes{0};
+    int64_t firstTimestamp{0};
+    int64_t lastTimestamp{0};
+};
+
+inline constexpr uint64_t CAPTURE_MAGIC = 0x31504143424f4351;
+
+// Varints as in protobuf: 7 bits per byte, low bits first, and zigzag to
+// make small negative differences small too
+inline void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+inline uint64_t getVarint(const uint8_t*& p) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t{b & 0x7fu} << shift;
+        if (b < 0x80) {
+            return v;
+        }
+    }
+}
+
+inline uint64_t toZigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t fromZigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+class CaptureWriter {
+   public:
+    // Check getIsOpen: the file may not have been created
+    explicit CaptureWriter(const std::string& path, size_t blockEvents = 4096)
+        : blockEvents(blockEvents), file(std::fopen(path.c_str(), "wb")) {
+        if (file) {
+            std::fwrite(&CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC), 1, file);
+            offset = sizeof(CAPTURE_MAGIC);
+            compressor = std::thread(&CaptureWriter::runCompressor, this);
+        }
+        filling.reserve(blockEvents);
+    }
+
+    ~CaptureWriter() { close(); }
+    CaptureWriter(const CaptureWriter& other) = delete;
+    CaptureWriter& operator=(const CaptureWriter& other) = delete;
+
+    bool getIsOpen() const { return file != nullptr; }
+
+    // From the matching thread, in timestamp order. Dropped if the file is
+    // not open (any more), as there is no compressor to take the blocks.
+    void append(const BookEvent& e) {
+        if (!file) {
+            return;
+        }
+        filling.push_back(e);
+        if (filling.size() == blockEvents) {
+            handOff();
+        }
+    }
+
+    void appendSnapshot(int64_t timestamp, int32_t symbol,
+                        const L2_Data& l2) {
+        if (!file) {
+            return;
+        }
+        for (bool isBid : {true, false}) {
+            for (const PriceLevel& level : isBid ? l2.bids : l2.offers) {
+                BookEvent e;
+                e.timestamp = timestamp;
+                e.symbol = symbol;
+                e.type = isBid ? EventType::SNAPSHOT_BID
+                               : EventType::SNAPSHOT_OFFER;
+                e.price = level.price;
+                e.size = level.totalSize;
+                e.isBid = isBid;
+                append(e);
+            }
+        }
+    }
+
+    // Writes out what is left and the index. Returns false if any write
+    // failed (then the file is incomplete).
+    bool close() {
+        if (!file) {
+            return false;
+        }
+        if (!filling.empty()) {
+            handOff();
+        }
+        {
+            std::scoped_lock lck(mtx);
+            stopping = true;
+        }
+        cvar.notify_one();
+        compressor.join();
+
+        uint64_t indexOffset = offset;
+        uint64_t numBlocks = index.size();
+        ok = ok &&
+             std::fwrite(index.data(), sizeof(CaptureBlockInfo), numBlocks,
+                         file) == numBlocks &&
+             std::fwrite(&indexOffset, sizeof(indexOffset), 1, file) == 1 &&
+             std::fwrite(&numBlocks, sizeof(numBlocks), 1, file) == 1 &&
+             std::fwrite(&CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC), 1, file) == 1;
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+    // Blocks the matching thread had to allocate because every recycled one
+    // was still waiting to be compressed
+    size_t getNumAllocatedBlocks() const { return numAllocated; }
+
+   private:
+    using Block = std::vector<BookEvent>;
+
+    void handOff() {
+        Block next;
+        {
+            std::scoped_lock lck(mtx);
+            full.push_back(std::move(filling));
+            if (!recycled.empty()) {
+                next = std::move(recycled.back());
+                recycled.pop_back();
+            }
+        }
+        cvar.notify_one();  // after unlocking, as in worker_pool.h
+        if (next.capacity() == 0) {
+            next.reserve(blockEvents);  // outside the lock
+            ++numAllocated;
+        }
+        filling = std::move(next);
+    }
+
+    void runCompressor() {
+        std::vector<uint8_t> bytes;
+        std::unique_lock lck(mtx);
+        while (true) {
+            cvar.wait(lck, [&]() { return stopping || !full.empty(); });
+            if (full.empty()) {
+                return;  // stopping, and every block is written
+            }
+            Block block = std::move(full.front());
+            full.pop_front();
+            lck.unlock();
+
+            encode(block, bytes);
+            ok = ok && std::fwrite(bytes.data(), 1, bytes.size(), file) ==
+                           bytes.size();
+            index.push_back({offset, static_cast<uint32_t>(block.size()),
+                             static_cast<uint32_t>(bytes.size()),
+                             block.front().timestamp,
+                             block.back().timestamp});
+            offset += bytes.size();
+            block.clear();  // keeps its capacity
+
+            lck.lock();
+            recycled.push_back(std::move(block));
+        }
+    }
+
+    // Appends column after column, each preceded by its length
+    static void encode(const Block& block, std::vector<uint8_t>& out) {
+        out.clear();
+        std::vector<uint8_t> column;
+        auto flush = [&]() {
+            uint32_t n = static_cast<uint32_t>(column.size());
+            out.insert(out.end(), reinterpret_cast<uint8_t*>(&n),
+                       reinterpret_cast<uint8_t*>(&n) + sizeof(n));
+            out.insert(out.end(), column.begin(), column.end());
+            column.clear();
+        };
+        int64_t prev = 0;
+        for (const BookEvent& e : block) {
+            putVarint(column, toZigzag(e.timestamp - prev));
+            prev = e.timestamp;
+        }
+        flush();
+        for (const BookEvent& e : block) {
+            putVarint(column, static_cast<uint32_t>(e.symbol));
+        }
+        flush();
+        for (const BookEvent& e : block) {
+            column.push_back(static_cast<uint8_t>(
+                static_cast<int>(e.type) << 1 | (e.isBid != 0)));
+        }
+        flush();
+        for (const BookEvent& e : block) {
+            putVarint(column, static_cast<uint32_t>(e.orderId));
+        }
+        flush();
+        prev = 0;
+        for (const BookEvent& e : block) {
+            putVarint(column, toZigzag(e.price - prev));
+            prev = e.price;
+        }
+        flush();
+        for (const BookEvent& e : block) {
+            putVarint(column, static_cast<uint32_t>(e.size));
+        }
+        flush();
+    }
+
+    const size_t blockEvents;
+    FILE* file;
+    Block filling;  // only touched by the matching thread
+
+    // Shared with the compressor under mtx
+    std::mutex mtx;
+    std::condition_variable cvar;
+    std::deque<Block> full;
+    std::vector<Block> recycled;
+    bool stopping{false};
+
+    // Only touched by the compressor until it is joined
+    std::thread compressor;
+    uint64_t offset{0};
+    std::vector<CaptureBlockInfo> index;
+    bool ok{true};
+
+    size_t numAllocated{0};
+};
+
+class CaptureReader {
+   public:
+    // Check getIsOpen: the file may be missing, truncated or not a capture
+    explicit CaptureReader(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size >= FOOTER_SIZE) {
+            size = static_cast<size_t>(st.st_size);
+            void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = p == MAP_FAILED ? nullptr : static_cast<uint8_t*>(p);
+        }
+        ::close(fd);  // the mapping stays
+        if (data && !readIndex()) {
+            ::munmap(data, size);
+            data = nullptr;
+        }
+    }
+
+    ~CaptureReader() {
+        if (data) {
+            ::munmap(data, size);
+        }
+    }
+    CaptureReader(const CaptureReader& other) = delete;
+    CaptureReader& operator=(const CaptureReader& other) = delete;
+
+    bool getIsOpen() const { return data != nullptr; }
+    const std::vector<CaptureBlockInfo>& getBlocks() const { return blocks; }
+
+    // Appends the events with from <= timestamp <= to, in capture order.
+    // Returns the number of blocks decoded.
+    size_t read(int64_t from, int64_t to, std::vector<BookEvent>& out) const {
+        // the first block that ends at or after from; timestamps never go
+        // back, so neither do the blocks' last timestamps
+        auto it = std::lower_bound(
+            blocks.begin(), blocks.end(), from,
+            [](const CaptureBlockInfo& b, int64_t t) {
+                return b.lastTimestamp < t;
+            });
+        size_t numDecoded = 0;
+        std::vector<BookEvent> block;
+        for (; it != blocks.end() && it->firstTimestamp <= to; ++it) {
+            decode(*it, block);
+            ++numDecoded;
+            for (const BookEvent& e : block) {
+                if (e.timestamp >= from && e.timestamp <= to) {
+                    out.push_back(e);
+                }
+            }
+        }
+        return numDecoded;
+    }
+
+   private:
+    static constexpr int64_t FOOTER_SIZE = 3 * sizeof(uint64_t);
+
+    bool readIndex() {
+        uint64_t magic = 0;
+        std::memcpy(&magic, data, sizeof(magic));
+        uint64_t footer[3];  // index offset, number of blocks, magic
+        std::memcpy(footer, data + size - FOOTER_SIZE, sizeof(footer));
+        uint64_t indexOffset = footer[0], numBlocks = footer[1];
+        if (magic != CAPTURE_MAGIC || footer[2] != CAPTURE_MAGIC ||
+            indexOffset + numBlocks * sizeof(CaptureBlockInfo) !=
+                size - FOOTER_SIZE) {
+            return false;
+        }
+        blocks.resize(numBlocks);
+        std::memcpy(blocks.data(), data + indexOffset,
+                    numBlocks * sizeof(CaptureBlockInfo));
+        for (const auto& b : blocks) {
+            if (b.offset + b.numBytes > indexOffset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void decode(const CaptureBlockInfo& info,
+                std::vector<BookEvent>& block) const {
+        block.assign(info.numEvents, BookEvent{});
+        const uint8_t* p = data + info.offset;
+        // each column's length is only needed by readers that skip it
+        auto column = [&]() { p += sizeof(uint32_t); };
+        int64_t prev = 0;
+        column();
+        for (BookEvent& e : block) {
+            e.timestamp = prev += fromZigzag(getVarint(p));
+        }
+        column();
+        for (BookEvent& e : block) {
+            e.symbol = static_cast<int32_t>(getVarint(p));
+        }
+        column();
+        for (BookEvent& e : block) {
+            uint8_t flags = *p++;
+            e.type = static_cast<EventType>(flags >> 1);
+            e.isBid = flags & 1;
+        }
+        column();
+        for (BookEvent& e : block) {
+            e.orderId = static_cast<int32_t>(getVarint(p));
+        }
+        prev = 0;
+        column();
+        for (BookEvent& e : block) {
+            e.price = static_cast<int32_t>(prev += fromZigzag(getVarint(p)));
+        }
+        column();
+        for (BookEvent& e : block) {
+            e.size = static_cast<int32_t>(getVarint(p));
+        }
+    }
+
+    uint8_t* data{nullptr};
+    size_t size{0};
+    std::vector<CaptureBlockInfo> blocks;
+};
+
+#endif  // CAPTURE_H_
@@ -0,0 +1,213 @@
+/*
+    A calendar spread and its two legs in one engine, so that spread orders
+   trade against outright liquidity directly instead of through an arbitrage
+   strategy outside the book. Buying the spread (front - back) at S means
+   buying the front leg and selling the back leg at prices that differ by S.
+
+   1) Implied-out: the legs' tops imply a spread market, e.g. the front offer
+   and the back bid together sell the spread at frontOffer - backBid. A spread
+   order that is at least as good as the better of the spread book and the
+   implied price trades against that one, and an implied trade is executed as
+   both leg orders back to back. Both legs are sized to what rests at their
+   tops, so neither can come up short, and nothing else can run in between:
+   the two fills happen together or not at all.
+   2) Implied-in: the spread and one leg imply a market in the other leg,
+   e.g. front bid = spread bid + back bid. These prices are published with
+   the implied-out ones for quoting, but are not traded against here.
+
+   Implied prices only depend on the three books' L1, so every order goes
+   through LinkedBooks, which compares the L1 of the book(s) it touched with
+   the last one it saw and recomputes the implied prices only if a top
+   changed. Orders deeper in a book cost nothing extra.
+
+   Spread prices may be negative, so the spread book stores price + maxPrice
+   and covers -maxPrice to maxPrice. All three books share one increment.
+*/
+
+#ifndef LINKED_BOOKS_H_
+#define LINKED_BOOKS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "order_book.h"
+
+// A price that totalSize <= 0 marks as absent (spread prices can be -1)
+struct ImpliedPrices {
+    PriceLevel spreadBid, spreadOffer;  // implied-out
+    PriceLevel frontBid, frontOffer;    // implied-in
+    PriceLevel backBid, backOffer;
+};
+
+struct SpreadFill {
+    int filledSize{0};
+    int impliedSize{0};      // the part of filledSize traded against the legs
+    int64_t filledValue{0};  // sum over spread price * qty
+    int restingId{-1};       // id of the rest in the spread book, if any
+};
+
+class LinkedBooks {
+   public:
+    enum Leg { FRONT = 0, BACK = 1, SPREAD = 2 };
+
+    LinkedBooks(int maxPrice, int increment)
+        : offset(maxPrice),
+          books{OrderBook(maxPrice, increment),
+                OrderBook(maxPrice, increment),
+                OrderBook(2 * maxPrice, increment)},
+          incr(increment) {}
+
+    // An outright order, as OrderBook::addOrder. A SPREAD order is not: it
+    // goes through addSpreadOrder, whose fills can be spread over all three
+    // books, so no one id covers them. The id is that of what is left to
+    // rest in the spread book, whose state there leaves out the earlier
+    // fills, and -1 if the order was filled in full (still true). See
+    // addSpreadOrder for the fills.
+    std::pair<bool, int> addOrder(Leg leg, int price, int orderSize,
+                                  bool isBid, int trader = 0) {
+        if (leg == SPREAD) {
+            auto [ok, fill] = addSpreadOrder(price, orderSize, isBid, trader);
+            return {ok, fill.restingId};
+        }
+        auto result = books[leg].addOrder(price, orderSize, isBid, -1, trader);
+        refresh(leg);
+        return result;
+    }
+
+    // Buys (isBid) or sells the spread at price or better, against the
+    // spread book and the implied price from the legs, whichever is better
+    // at each step (the spread book on a tie). What is left rests in the
+    // spread book. false iff the parameters are invalid.
+    std::pair<bool, SpreadFill> addSpreadOrder(int price, int orderSize,
+                                               bool isBid, int trader = 0) {
+        SpreadFill fill;
+        if (price < -offset || price > offset || price % incr != 0 ||
+            orderSize <= 0) {
+            return {false, fill};
+        }
+        OrderBook& spread = books[SPREAD];
+        int remaining = orderSize;
+        while (remaining > 0) {
+            L1_Data top = spread.getL1OrderData();
+            PriceLevel direct = isBid ? top.bestOffer : top.bestBid;
+            PriceLevel implied = isBid ? implieds.spreadOffer
+                                       : implieds.spreadBid;
+            if (direct.totalSize > 0) {
+                direct.price -= offset;
+            }
+            // the better of the two for us, as long as it is within price
+            auto isBetter = [&](int p, int q) {
+                return isBid ? p <= q : p >= q;
+            };
+            bool useDirect =
+                direct.totalSize > 0 &&
+                (implied.totalSize <= 0 || isBetter(direct.price,
+                                                    implied.price));
+            const PriceLevel& best = useDirect ? direct : implied;
+            if (best.totalSize <= 0 || !isBetter(best.price, price)) {
+                break;
+            }
+            int qty = std::min(remaining, best.totalSize);
+            if (useDirect) {
+                spread.addOrder(best.price + offset, qty, isBid, -1, trader);
+            } else {
+                tradeLegs(qty, isBid, trader);
+                fill.impliedSize += qty;
+            }
+            fill.filledSize += qty;
+            fill.filledValue += int64_t{best.price} * qty;
+            remaining -= qty;
+            refresh(SPREAD);
+        }
+        if (remaining > 0) {
+            fill.restingId =
+                spread.addOrder(price + offset, remaining, isBid, -1, trader)
+                    .second;
+            refresh(SPREAD);
+        }
+        return {true, fill};
+    }
+
+    std::pair<bool, OrderState> cancelOrder(Leg leg, int orderId) {
+        auto result = books[leg].cancelOrder(orderId);
+        refresh(leg);
+        return result;
+    }
+
+    const ImpliedPrices& getImpliedPrices() const { return implieds; }
+
+    // For queries (order status, L2...). Orders must go through
+    // LinkedBooks, or the implied prices go stale. Spread book prices are
+    // offset by maxPrice.
+    OrderBook& getBook(Leg leg) { return books[leg]; }
+
+    // How often the implied prices were recomputed, i.e. how often a top
+    // changed
+    int64_t getNumImpliedUpdates() const { return numImpliedUpdates; }
+
+   private:
+    // Both legs of qty implied spreads, at the legs' tops
+    void tradeLegs(int qty, bool isBid, int trader) {
+        L1_Data front = books[FRONT].getL1OrderData();
+        L1_Data back = books[BACK].getL1OrderData();
+        if (isBid) {  // buy the front, sell the back
+            books[FRONT].addOrder(front.bestOffer.price, qty, true, -1, trader);
+            books[BACK].addOrder(back.bestBid.price, qty, false, -1, trader);
+        } else {
+            books[FRONT].addOrder(front.bestBid.price, qty, false, -1, trader);
+            books[BACK].addOrder(back.bestOffer.price, qty, true, -1, trader);
+        }
+        refresh(FRONT);
+        refresh(BACK);
+    }
+
+    void refresh(Leg leg) {
+        L1_Data now = books[leg].getL1OrderData();
+        L1_Data& seen = tops[leg];
+        if (now.bestBid.price == seen.bestBid.price &&
+            now.bestBid.totalSize == seen.bestBid.totalSize &&
+            now.bestOffer.price == seen.bestOffer.price &&
+            now.bestOffer.totalSize == seen.bestOffer.totalSize) {
+            return;
+        }
+        seen = now;
+        recompute();
+    }
+
+    // a + b (sign = 1) or a - b (sign = -1), for as much as both have
+    static PriceLevel combine(const PriceLevel& a, const PriceLevel& b,
+                              int sign) {
+        if (a.totalSize <= 0 || b.totalSize <= 0) {
+            return PriceLevel{};
+        }
+        return {a.price + sign * b.price, std::min(a.totalSize, b.totalSize)};
+    }
+
+    void recompute() {
+        const L1_Data& f = tops[FRONT];
+        const L1_Data& b = tops[BACK];
+        L1_Data s = tops[SPREAD];
+        for (PriceLevel* p : {&s.bestBid, &s.bestOffer}) {
+            if (p->totalSize > 0) {
+                p->price -= offset;
+            }
+        }
+        implieds.spreadBid = combine(f.bestBid, b.bestOffer, -1);
+        implieds.spreadOffer = combine(f.bestOffer, b.bestBid, -1);
+        implieds.frontBid = combine(s.bestBid, b.bestBid, 1);
+        implieds.frontOffer = combine(s.bestOffer, b.bestOffer, 1);
+        implieds.backBid = combine(f.bestBid, s.bestOffer, -1);
+        implieds.backOffer = combine(f.bestOffer, s.bestBid, -1);
+        ++numImpliedUpdates;
+    }
+
+    const int offset;  // spread book price = spread price + offset
+    OrderBook books[3];
+    const int incr;
+    L1_Data tops[3];  // as last seen
+    ImpliedPrices implieds;
+    int64_t numImpliedUpdates{0};
+};
+
+#endif  // LINKED_BOOKS_H_
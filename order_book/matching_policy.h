@@ -0,0 +1,75 @@
+/*
+    How an incoming order's quantity is shared among the orders resting at a
+   price level that it does not take out completely. The book takes a policy
+   as a template parameter (see BasicOrderBook), so FIFO books pay nothing for
+   the others:
+   1) FifoMatching: strict price-time priority, the oldest order is filled
+   first (e.g. most equity venues).
+   2) ProRataMatching: every order gets floor(qty * size / level size). The
+   lots left over by rounding down, fewer than there are orders, then go one
+   each to the orders in time priority that still have room (the residual
+   rule of e.g. CME's pro-rata algorithm, without its 2-lot minimum).
+   3) TopOrderMatching: the oldest order at the level, i.e. the one that
+   opened the price, is filled first and the rest is shared pro rata (FIFO
+   plus top order, as on some futures venues).
+
+   A non-FIFO policy sees the remaining sizes of a level's orders in time
+   priority as one contiguous array and writes each order's fill into another,
+   so its loops are plain passes over arrays that the compiler can unroll and
+   vectorize. The book only calls it for qty < the level's total size; a
+   level that is taken out completely is filled the same way by every policy.
+*/
+
+#ifndef MATCHING_POLICY_H_
+#define MATCHING_POLICY_H_
+
+#include <algorithm>
+#include <cstdint>
+
+struct FifoMatching {
+    static constexpr bool IS_FIFO = true;
+};
+
+struct ProRataMatching {
+    static constexpr bool IS_FIFO = false;
+
+    // sizes[0] is the oldest order. qty < the sum of sizes.
+    static void allocate(const int* sizes, int n, int qty, int* fills) {
+        int64_t total = 0;
+        for (int i = 0; i < n; ++i) {
+            total += sizes[i];
+        }
+        int allocated = 0;
+        for (int i = 0; i < n; ++i) {
+            // exact: the product of two ints fits in 64 bits
+            fills[i] = static_cast<int>(int64_t{qty} * sizes[i] / total);
+            allocated += fills[i];
+        }
+        // Each order lost less than a lot to rounding, so the residual is
+        // smaller than the number of orders that lost anything, and those
+        // all have room for one more
+        int residual = qty - allocated;
+        for (int i = 0; residual > 0; ++i) {
+            if (fills[i] < sizes[i]) {
+                ++fills[i];
+                --residual;
+            }
+        }
+    }
+};
+
+struct TopOrderMatching {
+    static constexpr bool IS_FIFO = false;
+
+    static void allocate(const int* sizes, int n, int qty, int* fills) {
+        fills[0] = std::min(qty, sizes[0]);
+        if (n > 1 && qty > fills[0]) {
+            ProRataMatching::allocate(sizes + 1, n - 1, qty - fills[0],
+                                      fills + 1);
+        } else {
+            std::fill(fills + 1, fills + n, 0);
+        }
+    }
+};
+
+#endif  // MATCHING_POLICY_H_
@@ -2,82 +2,45 @@
 
 /* Public members*/
 
-OrderBook::OrderBook(int maxPrice, int increment)
-    : maxP(maxPrice), incr(increment) {
+template <typename Policy>
+BasicOrderBook<Policy>::BasicOrderBook(int maxPrice, int increment,
+                                       int64_t expiryTick)
+    : maxP(maxPrice), incr(increment), expiryTick(expiryTick) {
     if (maxPrice % increment != 0) {
         throw "maxPrice must be divisible by increment";
     }
+    if (expiryTick <= 0) {
+        throw "expiryTick must be positive";
+    }
     orderLevels.resize(maxPrice / increment + 1);  // value initialization
+    expiryWheel.resize(WHEEL_SIZE, -1);
+    orderSlots.push_back(-1);  // order ids start from 1
 }
 
-std::pair<bool, int> OrderBook::addOrder(int price, int orderSize, bool isBid) {
+template <typename Policy>
+std::pair<bool, int> BasicOrderBook<Policy>::addOrder(int price,
+                                                      int orderSize,
+                                                      bool isBid,
+                                                      int64_t expiryTime,
+                                                      int trader) {
     // Check order parameters
-    if (!getIsOrderValid(price, orderSize)) {
+    if (!getIsOrderValid(price, orderSize) ||
+        (expiryTime != -1 && expiryTime <= currTime)) {
         return {false, -1};
     }
-
-    int originalSize = orderSize;
-    int newIdx = price / incr;
-    int filledValue = 0;
-
-    if (isBid) {
-        int currOfferIdx = lastOfferIdx;
-        while (currOfferIdx >= 0 && currOfferIdx <= newIdx && orderSize > 0) {
-            auto [newOfferIdx, newOrderSize] =
-                fillOrdersAtCurrIdx(currOfferIdx, orderSize);
-            filledValue += (orderSize - newOrderSize) * currOfferIdx * incr;
-            currOfferIdx = newOfferIdx;
-            orderSize = newOrderSize;
-        }
-        lastOfferIdx = currOfferIdx;
-        if (currOfferIdx < 0) {  // Highest offer taken, none remain
-            firstOfferIdx = currOfferIdx;
-        }
-    } else {  // symmetrical for offers
-        int currBidIdx = lastBidIdx;
-        while (currBidIdx >= 0 && currBidIdx >= newIdx && orderSize > 0) {
-            auto [newBidIdx, newOrderSize] =
-                fillOrdersAtCurrIdx(currBidIdx, orderSize);
-            filledValue += (orderSize - newOrderSize) * currBidIdx * incr;
-            currBidIdx = newBidIdx;
-            orderSize = newOrderSize;
-        }
-        lastBidIdx = currBidIdx;
-        if (currBidIdx < 0) {  // Lowest bid given, none remain
-            firstBidIdx = currBidIdx;
-        }
-    }
-
-    // New order could have been instantly filled
-    if (orderSize == 0) {
-        // To be consistent with how we treat resting orders that are filled
-        doneOrderMap.try_emplace(nextOrderId, originalSize,
-                       static_cast<double>(filledValue) / originalSize);
-        return {true, nextOrderId++};
-    }
-
-    // Initialize the order level if needed
-    if (orderLevels[newIdx].totalSize == 0) {
-        // orderLevels[newIdx].orders.clear();  // should be already empty
-        addNewOrderLevel(newIdx, isBid);
-    }
-
-    // FIFO: always insert at the end of the order level
-    auto it = orderLevels[newIdx].orders.insert(
-        orderLevels[newIdx].orders.end(),
-        {price, originalSize, orderSize, filledValue});
-    orderLevels[newIdx].totalSize += orderSize;
-    activeOrderMap.insert_or_assign(nextOrderId, std::move(it));  // insert into hash map
-
+    orderSlots.push_back(-1);  // for nextOrderId, until it rests
+    placeOrder(nextOrderId, price, orderSize, isBid, expiryTime, trader);
     return {true, nextOrderId++};
 }
 
-std::pair<bool, OrderState> OrderBook::getOrderStatus(int orderId) {
-    if (activeOrderMap.find(orderId) != activeOrderMap.end()) {
-        auto orderIt = activeOrderMap.at(orderId);
-        int filledSize = orderIt->originalSize - orderIt->remainingSize;
+template <typename Policy>
+std::pair<bool, OrderState> BasicOrderBook<Policy>::getOrderStatus(
+    int orderId) const {
+    if (int slot = getSlot(orderId); slot >= 0) {
+        const LimitOrder& order = orderPool[slot];
+        int filledSize = order.originalSize - order.remainingSize;
         double averagePrice =  // construct adhoc for in-flight order
-            static_cast<double>(orderIt->filledValue) / filledSize;
+            static_cast<double>(order.filledValue) / filledSize;
         return {true, OrderState{filledSize, averagePrice}};
     }
     if (doneOrderMap.find(orderId) != doneOrderMap.end()) {
@@ -86,27 +49,20 @@ std::pair<bool, OrderState> OrderBook::getOrderStatus(int orderId) {
     return {false, OrderState{}};  // orderId does not exist
 }
 
-std::pair<bool, OrderState> OrderBook::cancelOrder(int orderId) {
+template <typename Policy>
+std::pair<bool, OrderState> BasicOrderBook<Policy>::cancelOrder(int orderId) {
     auto [active, os] = getOrderStatus(orderId);
     if (!active) {
         return {false, os};  // order does not exist or is done
     }
 
-    auto orderIt = activeOrderMap.at(orderId);
-    int currIdx = orderIt->price / incr;
-    orderLevels[currIdx].totalSize -= orderIt->remainingSize;
-    orderLevels[currIdx].orders.erase(orderIt);
-    activeOrderMap.erase(orderId);  // a cancelled order does not enter done map
-
-    if (orderLevels[currIdx].totalSize == 0) {
-        removeOrderLevel(currIdx);
-    }
-
+    removeOrder(getSlot(orderId));
     return {true, os};
 }
 
-std::pair<bool, OrderState> OrderBook::updateOrder(int orderId, int newPrice,
-                                                   int newSize) {
+template <typename Policy>
+std::pair<bool, OrderState> BasicOrderBook<Policy>::updateOrder(
+    int orderId, int newPrice, int newSize) {
     auto [active, os] = getOrderStatus(orderId);
     if (!active) {
         return {false, os};  // order does not exist or is done
@@ -117,30 +73,208 @@ std::pair<bool, OrderState> OrderBook::updateOrder(int orderId, int newPrice,
         return {false, os};
     }
 
-    auto orderIt = activeOrderMap.at(orderId);
-    int oldPrice = orderIt->price;
+    LimitOrder& order = orderPool[getSlot(orderId)];
+    int oldPrice = order.price;
+    int currIdx = oldPrice / incr;
     if (oldPrice == newPrice) {
-        orderIt->remainingSize = newSize - os.filledSize;
-        orderIt->originalSize = newSize;
+        int newRemainingSize = newSize - os.filledSize;
+        shiftWatchedBehind(currIdx, getSlot(orderId),
+                           newRemainingSize - order.remainingSize);
+        orderLevels[currIdx].totalSize +=
+            newRemainingSize - order.remainingSize;
+        checksum -= hashOrder(order);
+        order.remainingSize = newRemainingSize;
+        checksum += hashOrder(order);
+        order.originalSize = newSize;
         return {true, os};
     }
 
-    int currIdx = orderIt->price / incr;
     int price = newPrice;
     int orderSize = newSize - os.filledSize;
+    int64_t expiryTime = order.expiryTime;
+    int trader = order.trader;
     bool isBid = getIsBid(currIdx);  // check side before cancelling
 
+    // Same id, so that only addOrder hands out ids (see replay.h)
     cancelOrder(orderId);
-    auto [_, newOrderId] = addOrder(price, orderSize, isBid);
+    placeOrder(orderId, price, orderSize, isBid, expiryTime, trader);
+    return {true, os};
+}
 
-    // We remap orderId to newOrderId because we don't return newOrderId
-    activeOrderMap.insert_or_assign(orderId, std::move(activeOrderMap.at(newOrderId)));
-    activeOrderMap.erase(newOrderId);
+template <typename Policy>
+int BasicOrderBook<Policy>::advanceTime(int64_t now) {
+    if (now <= currTime) {
+        return 0;
+    }
+    // Every tick from the current one to now, but each slot at most once
+    int64_t firstTick = currTime / expiryTick;
+    int64_t lastTick = std::min(now / expiryTick, firstTick + WHEEL_SIZE - 1);
+    currTime = now;
+
+    int numExpired = 0;
+    for (int64_t tick = firstTick; tick <= lastTick; ++tick) {
+        int slot = expiryWheel[tick & (WHEEL_SIZE - 1)];
+        while (slot >= 0) {
+            int next = orderPool[slot].nextExpiring;  // before it is recycled
+            if (orderPool[slot].expiryTime <= now) {  // else in a later turn
+                removeOrder(slot);
+                ++numExpired;
+            }
+            slot = next;
+        }
+    }
+    return numExpired;
+}
 
-    return {true, os};
+template <typename Policy>
+int BasicOrderBook<Policy>::cancelTraderOrders(int trader) {
+    auto it = traderOrders.find(trader);
+    if (it == traderOrders.end()) {
+        return 0;
+    }
+    int numCancelled = 0;
+    for (int& head : it->second.headOrders) {
+        // the list goes as a whole, so its orders are not unlinked one by one
+        for (int slot = head; slot >= 0;) {
+            int next = orderPool[slot].nextOfTrader;
+            removeOrder(slot, false);
+            ++numCancelled;
+            slot = next;
+        }
+        head = -1;
+    }
+    return numCancelled;
+}
+
+template <typename Policy>
+int BasicOrderBook<Policy>::cancelPriceRange(bool isBid, int minPrice,
+                                             int maxPrice) {
+    if (maxPrice < 0) {
+        return 0;  // else it would round towards 0, onto the grid
+    }
+    int minIdx = std::max(minPrice, 0) / incr;
+    minIdx += minIdx * incr < minPrice;  // round up to a price on the grid
+    int maxIdx = std::min(maxPrice, maxP) / incr;
+    if (minIdx > maxIdx) {
+        return 0;
+    }
+
+    // Walk from the best level towards worse ones (via prevIdx on both
+    // sides). The levels in the range are contiguous, so they come off the
+    // side in one piece: the better neighbour is linked to the worse one.
+    int& bestIdx = isBid ? lastBidIdx : lastOfferIdx;
+    int& worstIdx = isBid ? firstBidIdx : firstOfferIdx;
+    auto isBetter = [&](int idx) {
+        return isBid ? idx > maxIdx : idx < minIdx;
+    };
+    int betterIdx = -1;
+    int currIdx = bestIdx;
+    while (currIdx >= 0 && isBetter(currIdx)) {
+        betterIdx = currIdx;
+        currIdx = orderLevels[currIdx].prevIdx;
+    }
+    int numCancelled = 0;
+    levelHeads.clear();
+    while (currIdx >= minIdx && currIdx <= maxIdx) {
+        auto& level = orderLevels[currIdx];
+        numCancelled += level.numOrders;
+        levelHeads.push_back(level.headOrder);
+        level.headOrder = level.tailOrder = -1;  // the orders go below
+        level.headWatched = level.tailWatched = -1;
+        level.totalSize = 0;
+        level.numOrders = 0;
+        currIdx = level.prevIdx;
+    }
+    if (numCancelled == 0) {
+        return 0;
+    }
+    // If the whole side goes, so does every trader's list for it, which
+    // saves unlinking each order from its neighbours there
+    bool wholeSide = betterIdx < 0 && currIdx < 0;
+    if (wholeSide) {
+        for (auto& [_, orders] : traderOrders) {
+            orders.headOrders[isBid] = -1;
+        }
+    }
+    auto cancel = [&](int slot) {
+        if (!wholeSide) {
+            unlinkFromTrader(slot);
+        }
+        forgetOrder(slot);
+    };
+    // Walking a level visits its orders one cache miss after another, as
+    // each slot holds the next one's. The levels are walked side by side
+    // instead, a step of each in turn, so that a miss per level is in
+    // flight. For a good part of the pool it is cheaper still to go through
+    // all of it in memory order: the range is every order on its side from
+    // minIdx to maxIdx.
+    if (numCancelled >= static_cast<int>(orderPool.size()) / SWEEP_SHARE) {
+        for (int slot = 0; slot < static_cast<int>(orderPool.size());
+             ++slot) {
+            const LimitOrder& order = orderPool[slot];
+            int idx = order.price / incr;
+            if (order.orderId > 0 && order.isBid == isBid && idx >= minIdx &&
+                idx <= maxIdx) {
+                cancel(slot);
+            }
+        }
+    } else {
+        while (!levelHeads.empty()) {
+            for (size_t i = 0; i < levelHeads.size();) {
+                int slot = levelHeads[i];
+                int next = orderPool[slot].nextInLevel;
+                cancel(slot);
+                if (next >= 0) {
+                    levelHeads[i++] = next;
+                } else {  // that level is done
+                    levelHeads[i] = levelHeads.back();
+                    levelHeads.pop_back();
+                }
+            }
+        }
+    }
+    if (betterIdx >= 0) {
+        orderLevels[betterIdx].prevIdx = currIdx;
+    } else {
+        bestIdx = currIdx;
+    }
+    if (currIdx >= 0) {
+        orderLevels[currIdx].nextIdx = betterIdx;
+    } else {
+        worstIdx = betterIdx;
+    }
+    return numCancelled;
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::watchTrader(int trader) {
+    traderOrders[trader].isWatched = true;
+}
+
+template <typename Policy>
+std::pair<bool, int> BasicOrderBook<Policy>::getQueuePosition(
+    int orderId) const {
+    int slot = getSlot(orderId);
+    if (slot < 0) {
+        return {false, 0};
+    }
+    const LimitOrder& order = orderPool[slot];
+    const OrderLevel& level = orderLevels[order.price / incr];
+    if (order.isWatched) {
+        // once it is at the front, its own fills count too, hence the max
+        int64_t filledSince = level.filledSize - order.fillsAtEntry;
+        return {true, static_cast<int>(std::max<int64_t>(
+                          order.queueAhead - filledSince, 0))};
+    }
+    int ahead = 0;
+    for (int s = level.headOrder; s != slot; s = orderPool[s].nextInLevel) {
+        ahead += orderPool[s].remainingSize;
+    }
+    return {true, ahead};
 }
 
-L1_Data OrderBook::getL1OrderData() {
+template <typename Policy>
+L1_Data BasicOrderBook<Policy>::getL1OrderData() const {
     PriceLevel bestBid, bestOffer;
     if (lastBidIdx >= 0) {
         bestBid.price = lastBidIdx * incr;
@@ -153,7 +287,8 @@ L1_Data OrderBook::getL1OrderData() {
     return {bestBid, bestOffer};
 }
 
-L2_Data OrderBook::getL2OrderData() {
+template <typename Policy>
+L2_Data BasicOrderBook<Policy>::getL2OrderData() const {
     std::vector<PriceLevel> bids, offers;
     int currBidIdx = lastBidIdx;
     while (currBidIdx >= 0) {
@@ -169,30 +304,132 @@ L2_Data OrderBook::getL2OrderData() {
     return {bids, offers};
 }
 
+template <typename Policy>
+uint64_t BasicOrderBook<Policy>::computeChecksum() const {
+    uint64_t sum = 0;
+    for (const LimitOrder& order : orderPool) {
+        if (order.orderId > 0) {  // else a free slot
+            sum += hashOrder(order);
+        }
+    }
+    return sum;
+}
+
 /* Private members*/
 
-inline std::pair<int, int> OrderBook::fillOrdersAtCurrIdx(const int currIdx,
-                                                          int orderSize) {
-    auto currOrderIt = orderLevels[currIdx].orders.begin();
-    while (currOrderIt != orderLevels[currIdx].orders.end() && orderSize > 0) {
-        int qtyFilled = std::min(orderSize, currOrderIt->remainingSize);
+template <typename Policy>
+void BasicOrderBook<Policy>::placeOrder(int orderId, int price, int orderSize,
+                                        bool isBid, int64_t expiryTime,
+                                        int trader) {
+    int originalSize = orderSize;
+    int newIdx = price / incr;
+    int filledValue = 0;
+
+    if (isBid) {
+        int currOfferIdx = lastOfferIdx;
+        while (currOfferIdx >= 0 && currOfferIdx <= newIdx && orderSize > 0) {
+            auto [newOfferIdx, newOrderSize] =
+                fillOrdersAtCurrIdx(currOfferIdx, orderSize);
+            filledValue += (orderSize - newOrderSize) * currOfferIdx * incr;
+            currOfferIdx = newOfferIdx;
+            orderSize = newOrderSize;
+        }
+        lastOfferIdx = currOfferIdx;
+        if (currOfferIdx < 0) {  // Highest offer taken, none remain
+            firstOfferIdx = currOfferIdx;
+        } else {
+            orderLevels[currOfferIdx].nextIdx = -1;  // lower offers are gone
+        }
+    } else {  // symmetrical for offers
+        int currBidIdx = lastBidIdx;
+        while (currBidIdx >= 0 && currBidIdx >= newIdx && orderSize > 0) {
+            auto [newBidIdx, newOrderSize] =
+                fillOrdersAtCurrIdx(currBidIdx, orderSize);
+            filledValue += (orderSize - newOrderSize) * currBidIdx * incr;
+            currBidIdx = newBidIdx;
+            orderSize = newOrderSize;
+        }
+        lastBidIdx = currBidIdx;
+        if (currBidIdx < 0) {  // Lowest bid given, none remain
+            firstBidIdx = currBidIdx;
+        } else {
+            orderLevels[currBidIdx].nextIdx = -1;  // higher bids are gone
+        }
+    }
+
+    // New order could have been instantly filled
+    if (orderSize == 0) {
+        // To be consistent with how we treat resting orders that are filled
+        doneOrderMap.try_emplace(orderId, originalSize,
+                       static_cast<double>(filledValue) / originalSize);
+        return;
+    }
+
+    // Initialize the order level if needed
+    if (orderLevels[newIdx].totalSize == 0) {
+        addNewOrderLevel(newIdx, isBid);
+    }
+
+    int slot = acquireSlot();
+    LimitOrder& order = orderPool[slot];
+    order.price = price;
+    order.originalSize = originalSize;
+    order.remainingSize = orderSize;
+    order.filledValue = filledValue;
+    order.orderId = orderId;
+    order.expiryTime = expiryTime;
+    order.trader = trader;
+    order.isBid = isBid;
+
+    // FIFO: always insert at the end of the order level
+    appendToLevel(newIdx, slot);
+    linkToTrader(slot);  // sees the level's size before this order
+    orderLevels[newIdx].totalSize += orderSize;
+    if (expiryTime >= 0) {
+        linkExpiring(slot);
+    }
+    orderSlots[orderId] = slot;
+    checksum += hashOrder(order);
+}
+
+template <typename Policy>
+uint64_t BasicOrderBook<Policy>::hashOrder(const LimitOrder& order) {
+    // splitmix64's finalizer over the fields (the size spread over all 64
+    // bits first, the side in the top bit, which an id never reaches), so
+    // that terms for orders that differ in a single bit look unrelated and
+    // do not cancel out in the sum
+    auto mix = [](uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    };
+    uint64_t key = uint64_t{order.isBid} << 63 |
+                   static_cast<uint64_t>(static_cast<uint32_t>(order.orderId))
+                       << 32 |
+                   static_cast<uint32_t>(order.price);
+    return mix(key ^ static_cast<uint32_t>(order.remainingSize) *
+                         0x9e3779b97f4a7c15);
+}
+
+template <typename Policy>
+inline std::pair<int, int> BasicOrderBook<Policy>::fillOrdersAtCurrIdx(
+    const int currIdx, int orderSize) {
+    if constexpr (!Policy::IS_FIFO) {
+        if (orderSize < orderLevels[currIdx].totalSize) {
+            allocateAtCurrIdx(currIdx, orderSize);
+            return {currIdx, 0};
+        }
+    }  // else every order in turn, which is what any policy does to a level
+       // that is taken out completely
+    while (orderLevels[currIdx].headOrder >= 0 && orderSize > 0) {
+        int slot = orderLevels[currIdx].headOrder;
+        int qtyFilled = std::min(orderSize, orderPool[slot].remainingSize);
         orderSize -= qtyFilled;
-        currOrderIt->remainingSize -= qtyFilled;
-        currOrderIt->filledValue += qtyFilled * currIdx * incr;
-        orderLevels[currIdx].totalSize -= qtyFilled;
-        if (currOrderIt->remainingSize == 0) {
-            // move from active orders to done orders (see .h for alternative)
-            activeOrderMap.erase(currIdx);
-            doneOrderMap.try_emplace(currIdx, currOrderIt->originalSize,
-                           static_cast<double>(currOrderIt->filledValue) /
-                               currOrderIt->originalSize);
-            ++currOrderIt;
-        }  // else orderSize = 0, will break in next iteration
-    }
-
-    // Remove from the linked list all orders that have been filled
-    orderLevels[currIdx].orders.erase(orderLevels[currIdx].orders.begin(),
-                                      currOrderIt);
+        orderLevels[currIdx].filledSize += qtyFilled;
+        fillOrder(currIdx, slot, qtyFilled);  // the next order may be the head
+    }
     if (orderLevels[currIdx].totalSize == 0) {
         // totalSize = 0 for this level so go to next level
         return {orderLevels[currIdx].prevIdx, orderSize};
@@ -200,7 +437,56 @@ inline std::pair<int, int> OrderBook::fillOrdersAtCurrIdx(const int currIdx,
     return {currIdx, orderSize};
 }
 
-void OrderBook::addNewOrderLevel(int newIdx, bool isBid) {
+template <typename Policy>
+void BasicOrderBook<Policy>::allocateAtCurrIdx(int currIdx, int orderSize) {
+    if constexpr (!Policy::IS_FIFO) {
+        // the level's sizes in time priority, side by side for the policy
+        levelSizes.clear();
+        for (int slot = orderLevels[currIdx].headOrder; slot >= 0;
+             slot = orderPool[slot].nextInLevel) {
+            levelSizes.push_back(orderPool[slot].remainingSize);
+        }
+        levelFills.resize(levelSizes.size());
+        Policy::allocate(levelSizes.data(),
+                         static_cast<int>(levelSizes.size()), orderSize,
+                         levelFills.data());
+
+        int i = 0;
+        for (int slot = orderLevels[currIdx].headOrder; slot >= 0; ++i) {
+            int next = orderPool[slot].nextInLevel;  // before it is recycled
+            if (levelFills[i] > 0) {
+                // Not from the front, so for queue positions this is like
+                // the order shrinking rather than like a FIFO fill
+                shiftWatchedBehind(currIdx, slot, -levelFills[i]);
+                fillOrder(currIdx, slot, levelFills[i]);
+            }
+            slot = next;
+        }
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::fillOrder(int currIdx, int slot, int qty) {
+    LimitOrder& order = orderPool[slot];
+    checksum -= hashOrder(order);
+    order.remainingSize -= qty;
+    order.filledValue += qty * currIdx * incr;
+    checksum += hashOrder(order);  // taken out again if it is done
+    orderLevels[currIdx].totalSize -= qty;
+    if (order.remainingSize == 0) {
+        // move from active orders to done orders (see .h for why)
+        doneOrderMap.try_emplace(
+            order.orderId, order.originalSize,
+            static_cast<double>(order.filledValue) / order.originalSize);
+        releaseOrder(slot);
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::addNewOrderLevel(int newIdx, bool isBid) {
+    // the level may have been used before, with links that are now stale
+    orderLevels[newIdx].nextIdx = -1;
+    orderLevels[newIdx].prevIdx = -1;
     if (isBid) {
         if (lastBidIdx < 0) {
             // this is the only bid
@@ -258,7 +544,8 @@ void OrderBook::addNewOrderLevel(int newIdx, bool isBid) {
     }
 }
 
-void OrderBook::removeOrderLevel(int currIdx) {
+template <typename Policy>
+void BasicOrderBook<Policy>::removeOrderLevel(int currIdx) {
     bool isBid = getIsBid(currIdx);
 
     // We can skip updating our own pointers because they are now unreachable
@@ -286,8 +573,187 @@ void OrderBook::removeOrderLevel(int currIdx) {
             lastOfferIdx = prevIdx;
         }
         if (prevIdx < 0) {
-            firstBidIdx = nextIdx;
+            firstOfferIdx = nextIdx;
         }
     }
 }
 
+template <typename Policy>
+int BasicOrderBook<Policy>::acquireSlot() {
+    if (freeSlots.empty()) {
+        orderPool.emplace_back();
+        return static_cast<int>(orderPool.size()) - 1;
+    }
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::releaseOrder(int slot, bool unlinkTrader) {
+    LimitOrder& order = orderPool[slot];
+    auto& level = orderLevels[order.price / incr];
+    if (order.prevInLevel >= 0) {
+        orderPool[order.prevInLevel].nextInLevel = order.nextInLevel;
+    } else {
+        level.headOrder = order.nextInLevel;
+    }
+    if (order.nextInLevel >= 0) {
+        orderPool[order.nextInLevel].prevInLevel = order.prevInLevel;
+    } else {
+        level.tailOrder = order.prevInLevel;
+    }
+    --level.numOrders;
+    if (order.isWatched) {
+        unlinkWatched(order.price / incr, slot);
+    }
+    if (unlinkTrader) {
+        unlinkFromTrader(slot);
+    }
+    forgetOrder(slot);
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::forgetOrder(int slot) {
+    unlinkExpiring(slot);
+    checksum -= hashOrder(orderPool[slot]);
+    orderSlots[orderPool[slot].orderId] = -1;
+    orderPool[slot] = LimitOrder{};
+    freeSlots.push_back(slot);
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::removeOrder(int slot, bool unlinkTrader) {
+    int currIdx = orderPool[slot].price / incr;
+    orderLevels[currIdx].totalSize -= orderPool[slot].remainingSize;
+    shiftWatchedBehind(currIdx, slot, -orderPool[slot].remainingSize);
+    // a cancelled order does not enter done map
+    releaseOrder(slot, unlinkTrader);
+
+    if (orderLevels[currIdx].totalSize == 0) {
+        removeOrderLevel(currIdx);
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::appendToLevel(int currIdx, int slot) {
+    auto& level = orderLevels[currIdx];
+    orderPool[slot].prevInLevel = level.tailOrder;
+    orderPool[slot].nextInLevel = -1;
+    orderPool[slot].queueSeq = ++nextQueueSeq;
+    if (level.tailOrder >= 0) {
+        orderPool[level.tailOrder].nextInLevel = slot;
+    } else {
+        level.headOrder = slot;
+    }
+    level.tailOrder = slot;
+    ++level.numOrders;
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::linkToTrader(int slot) {
+    LimitOrder& order = orderPool[slot];
+    auto& trader = traderOrders[order.trader];  // kept once a trader is seen
+    int& head = trader.headOrders[order.isBid];
+    order.prevOfTrader = -1;
+    order.nextOfTrader = head;
+    if (head >= 0) {
+        orderPool[head].prevOfTrader = slot;
+    }
+    head = slot;
+    if (trader.isWatched) {
+        linkWatched(order.price / incr, slot);
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::linkExpiring(int slot) {
+    LimitOrder& order = orderPool[slot];
+    int& head =
+        expiryWheel[(order.expiryTime / expiryTick) & (WHEEL_SIZE - 1)];
+    order.prevExpiring = -1;
+    order.nextExpiring = head;
+    if (head >= 0) {
+        orderPool[head].prevExpiring = slot;
+    }
+    head = slot;
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::unlinkFromTrader(int slot) {
+    const LimitOrder& order = orderPool[slot];
+    if (order.prevOfTrader >= 0) {
+        orderPool[order.prevOfTrader].nextOfTrader = order.nextOfTrader;
+    } else {
+        traderOrders[order.trader].headOrders[order.isBid] =
+            order.nextOfTrader;
+    }
+    if (order.nextOfTrader >= 0) {
+        orderPool[order.nextOfTrader].prevOfTrader = order.prevOfTrader;
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::unlinkExpiring(int slot) {
+    const LimitOrder& order = orderPool[slot];
+    if (order.expiryTime < 0) {
+        return;  // day orders are never linked
+    }
+    if (order.prevExpiring >= 0) {
+        orderPool[order.prevExpiring].nextExpiring = order.nextExpiring;
+    } else {
+        expiryWheel[(order.expiryTime / expiryTick) & (WHEEL_SIZE - 1)] =
+            order.nextExpiring;
+    }
+    if (order.nextExpiring >= 0) {
+        orderPool[order.nextExpiring].prevExpiring = order.prevExpiring;
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::linkWatched(int currIdx, int slot) {
+    auto& level = orderLevels[currIdx];
+    LimitOrder& order = orderPool[slot];
+    order.isWatched = true;
+    order.queueAhead = level.totalSize;  // which does not include it yet
+    order.fillsAtEntry = level.filledSize;
+    order.prevWatched = level.tailWatched;
+    order.nextWatched = -1;
+    if (level.tailWatched >= 0) {
+        orderPool[level.tailWatched].nextWatched = slot;
+    } else {
+        level.headWatched = slot;
+    }
+    level.tailWatched = slot;
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::unlinkWatched(int currIdx, int slot) {
+    auto& level = orderLevels[currIdx];
+    const LimitOrder& order = orderPool[slot];
+    if (order.prevWatched >= 0) {
+        orderPool[order.prevWatched].nextWatched = order.nextWatched;
+    } else {
+        level.headWatched = order.nextWatched;
+    }
+    if (order.nextWatched >= 0) {
+        orderPool[order.nextWatched].prevWatched = order.prevWatched;
+    } else {
+        level.tailWatched = order.prevWatched;
+    }
+}
+
+template <typename Policy>
+void BasicOrderBook<Policy>::shiftWatchedBehind(int currIdx, int slot,
+                                                int delta) {
+    // from the back of the level, so only watched orders behind it are seen
+    int64_t seq = orderPool[slot].queueSeq;
+    for (int s = orderLevels[currIdx].tailWatched;
+         s >= 0 && orderPool[s].queueSeq > seq; s = orderPool[s].prevWatched) {
+        orderPool[s].queueAhead += delta;
+    }
+}
+
+template class BasicOrderBook<FifoMatching>;
+template class BasicOrderBook<ProRataMatching>;
+template class BasicOrderBook<TopOrderMatching>;
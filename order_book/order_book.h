@@ -1,8 +1,13 @@
-#include <list>
+#ifndef ORDER_BOOK_H_
+#define ORDER_BOOK_H_
+
+#include <cstdint>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "matching_policy.h"
+
 // Public structs
 
 struct OrderState {
@@ -31,30 +36,67 @@ struct LimitOrder {
     int originalSize{0};
     int remainingSize{0};
     int filledValue{0};  // sum over price of price * qty filled at that price
+    int orderId{0};
+    int64_t expiryTime{-1};  // -1 = day order, otherwise good till this time
+    int trader{0};
+    bool isBid{false};
+    // Intrusive links, as slots in the order pool (-1 = none): the FIFO of
+    // its level, the list of its trader's resting orders on its side and,
+    // for a good-till-time order, the list of its expiry wheel slot
+    int nextInLevel{-1}, prevInLevel{-1};
+    int nextOfTrader{-1}, prevOfTrader{-1};
+    int nextExpiring{-1}, prevExpiring{-1};
+    int64_t queueSeq{0};  // arrival at its level, larger = further back
+    // Only for orders of watched traders (see getQueuePosition): the size
+    // ahead of it at its level, which fills there since fillsAtEntry have
+    // eaten into, and the list of the level's watched orders
+    bool isWatched{false};
+    int queueAhead{0};
+    int64_t fillsAtEntry{0};
+    int nextWatched{-1}, prevWatched{-1};
 };
 
 struct OrderLevel {
-    std::list<LimitOrder> orders;
+    int headOrder{-1};  // oldest order, the first to be filled
+    int tailOrder{-1};
     int totalSize{0};  // 0 = empty and potentially uninitialized, can skip
-    int nextIdx{-1};   // index of next higher bid or lower offer
+    int numOrders{0};
+    int64_t filledSize{0};  // ever filled at this price, only ever grows
+    int headWatched{-1};    // orders of watched traders, oldest first
+    int tailWatched{-1};
+    int nextIdx{-1};  // index of next higher bid or lower offer
     int prevIdx{-1};
 };
 
-class OrderBook {
+// Policy decides how a level that an incoming order only partly takes is
+// shared among its orders (see matching_policy.h). The member functions are
+// defined in order_book.cpp and instantiated there for the policies in
+// matching_policy.h.
+template <typename Policy>
+class BasicOrderBook {
    public:
-    OrderBook(int maxPrice, int increment);
-    virtual ~OrderBook() = default;  // virtual destructor
+    // Times (see advanceTime) are in whatever unit the caller picks, e.g. ms
+    // since midnight. expiryTick is the width of one slot of the expiry wheel
+    // in that unit; orders expire at the first advanceTime at or after their
+    // expiryTime regardless, but the wheel only spans WHEEL_SIZE ticks, and
+    // orders further out are passed over once per turn of the wheel.
+    BasicOrderBook(int maxPrice, int increment, int64_t expiryTick = 1);
+    virtual ~BasicOrderBook() = default;  // virtual destructor
 
     // Adds a new order. Returns true iff parameters are valid and a new orderId
     // that can be used to query its state. If the (aggressive) order is filled
-    // immediately, a valid orderId is still returned.
-    std::pair<bool, int> addOrder(int price, int orderSize, bool isBid);
+    // immediately, a valid orderId is still returned. A good-till-time order
+    // (expiryTime >= 0) must expire after the book's current time; whatever
+    // part of it still rests then is cancelled by advanceTime. trader is an
+    // id of the caller's choosing, for cancelTraderOrders.
+    std::pair<bool, int> addOrder(int price, int orderSize, bool isBid,
+                                  int64_t expiryTime = -1, int trader = 0);
 
     // Queries the state of an order without modifying it. The first return
     // value is true iff order is active (i.e. exists and not cancelled or fully
     // filled) and the second is the state of the order as defined above, if it
     // is active or fully filled.
-    std::pair<bool, OrderState> getOrderStatus(int orderId);
+    std::pair<bool, OrderState> getOrderStatus(int orderId) const;
 
     // Cancels unfilled part of existing order. The first return value is true
     // iff the operation succeeds, which is when the order is valid. The second
@@ -68,15 +110,58 @@ class OrderBook {
     // If newPrice = old price, we set originalSize = newSize and remainingSize
     // = newSize - filled amount in the existing order and do not change its
     // priority. Otherwise, this function cancels the current order and enters a
-    // new order with originalSize = remainingSize = newSize - filled amount.
-    // NOP and status = false if remainingSize <= 0.
+    // new order with originalSize = remainingSize = newSize - filled amount,
+    // under the same orderId.
+    // NOP and status = false if remainingSize <= 0. The expiry time is kept.
     std::pair<bool, OrderState> updateOrder(int orderId, int newPrice,
                                             int newSize);
 
-    L1_Data getL1OrderData();
-    L2_Data getL2OrderData();
+    // Moves the book's clock forward to now and cancels every resting order
+    // whose expiryTime <= now, in bulk, slot by slot of the expiry wheel.
+    // Returns the number of orders expired. Time never goes back.
+    int advanceTime(int64_t now);
+
+    // Mass cancels (e.g. a kill switch or the end of a session). Each returns
+    // the number of orders cancelled and costs O(orders cancelled) plus, for
+    // price ranges, the number of levels in front of the range and, for a
+    // whole side, the number of traders ever seen. Cancelled orders do not
+    // enter the done map, as with cancelOrder. Per order, cancelTraderOrders
+    // is no faster than cancelOrder: each order still comes off its level,
+    // at a cache miss or more, and only the id lookup and the trader unlink
+    // are saved.
+    int cancelTraderOrders(int trader);
+    int cancelPriceRange(bool isBid, int minPrice, int maxPrice);
+    int cancelSide(bool isBid) { return cancelPriceRange(isBid, 0, maxP); }
+
+    // Queue position: the first return value is true iff the order is
+    // resting, and the second is the total size of the orders ahead of it at
+    // its price. For orders that a watched trader adds after watchTrader,
+    // this is O(1): fills only ever come off the front of a level, so they
+    // are counted once per level, and a cancel or resize only corrects the
+    // watched orders behind it. Other orders are answered by walking their
+    // level from the front.
+    void watchTrader(int trader);
+    std::pair<bool, int> getQueuePosition(int orderId) const;
+
+    L1_Data getL1OrderData() const;
+    L2_Data getL2OrderData() const;
+
+    // A hash of every resting order's id, side, price and remaining size, to
+    // tell whether a replica or a recovered book matches the primary without
+    // serializing either. It is a sum of one hash per order (mod 2^64), so
+    // it does not depend on the order in which orders arrived and each add,
+    // fill or cancel updates it in O(1). Books that compare equal after
+    // every batch of a journal but not after the last one diverged in that
+    // batch, which can then be bisected. computeChecksum recomputes it from
+    // scratch, in O(resting orders).
+    uint64_t getChecksum() const { return checksum; }
+    uint64_t computeChecksum() const;
 
    private:
+    static constexpr int WHEEL_SIZE = 1024;  // slots, a power of 2
+    // cancelPriceRange sweeps the pool for at least 1/SWEEP_SHARE of it
+    static constexpr int SWEEP_SHARE = 4;
+
     const int maxP, incr;  // max price and the price increment per index
     int nextOrderId{1};    // next order id is incremented by 1 each time
 
@@ -87,27 +172,100 @@ class OrderBook {
     int firstBidIdx{-1}, lastBidIdx{-1};      // last bid = highest bid
     int firstOfferIdx{-1}, lastOfferIdx{-1};  // last offer = lowest offer
 
-    // Maps orderId to Order object. We can use a vector, but then we have to
-    // indicate cancelled orders (std::optional?) because invalidated iterators
-    // cannot be safely dereferenced. We can't use a vector<LimitOrder*> either,
-    // because we are manipulating a STL list rather than a handcrafted list.
+    // Resting orders live in a pool (in the spirit of the arena in engine.c)
+    // and are linked into handcrafted lists by slot, so a level, a trader or
+    // a wheel slot can be walked and unlinked without any lookup, and a slot
+    // goes back on the free list instead of back to the allocator. Slots stay
+    // valid when the vector grows, unlike pointers or list iterators.
     // https://stackoverflow.com/questions/2062956/checking-if-an-iterator-is-valid
-    std::unordered_map<int, std::list<LimitOrder>::iterator> activeOrderMap;
+    std::vector<LimitOrder> orderPool;
+    std::vector<int> freeSlots;
+
+    // Maps orderId to its slot, or -1 if it is not resting (any more). Order
+    // ids are handed out densely, so this is a vector rather than a hash map,
+    // at 4 bytes per order ever added.
+    std::vector<int> orderSlots;
 
     // Stores the amount and average price of completed orders. This map
-    // excludes cancelled orders and the filled part of orders with price
-    // updates. We need to store completed orders in another data structure
-    // because we can't make a STL list skip done orders without also destroying
-    // them or manually pointing to the head of the list (a drawback of
-    // automatic memory management?). With a handcrafted list we can just move
-    // the head pointer accordingly and delete all done orders when we need to
-    // manage memory.
+    // excludes cancelled orders and, for an order whose price was updated,
+    // what was filled before that. A filled order's slot is recycled right
+    // away, so its final state has to be kept somewhere else.
     std::unordered_map<int, OrderState> doneOrderMap;
 
+    // A hashed timing wheel: good-till-time orders are linked into slot
+    // (expiryTime / expiryTick) % WHEEL_SIZE, so advancing the clock only
+    // visits the slots of the ticks that passed and the orders in them.
+    const int64_t expiryTick;
+    int64_t currTime{0};
+    std::vector<int> expiryWheel;  // head of each slot's list
+
+    // Each trader's resting orders, one list per side so that cancelSide
+    // can drop them without visiting each order, and whether their queue
+    // positions are tracked
+    struct TraderOrders {
+        int headOrders[2]{-1, -1};  // offers, bids
+        bool isWatched{false};
+    };
+    std::unordered_map<int, TraderOrders> traderOrders;
+    int64_t nextQueueSeq{0};
+
+    uint64_t checksum{0};
+
+    // One order's term in checksum
+    static uint64_t hashOrder(const LimitOrder& order);
+
+    // Matches an order that has passed addOrder's checks and rests what is
+    // left of it, as orderId
+    void placeOrder(int orderId, int price, int orderSize, bool isBid,
+                    int64_t expiryTime, int trader);
+
+    // Returns a slot for a new resting order, not linked to anything yet
+    int acquireSlot();
+
+    // Unlinks a resting order from its level, its trader (unless the caller
+    // drops the trader's list as a whole) and the expiry wheel and recycles
+    // its slot. The level's totalSize is up to the caller.
+    void releaseOrder(int slot, bool unlinkTrader = true);
+
+    // Same, but leaves the level's and the trader's lists alone
+    void forgetOrder(int slot);
+
+    // Cancels a resting order and removes its level if that is now empty
+    void removeOrder(int slot, bool unlinkTrader = true);
+
+    void appendToLevel(int currIdx, int slot);
+    void linkToTrader(int slot);
+    void linkExpiring(int slot);
+    void unlinkFromTrader(int slot);
+    void unlinkExpiring(int slot);
+    void linkWatched(int currIdx, int slot);
+    void unlinkWatched(int currIdx, int slot);
+
+    // The remaining size of the order at slot changes by delta (< 0 for a
+    // cancel), which moves every watched order behind it
+    void shiftWatchedBehind(int currIdx, int slot, int delta);
+
+    // The slot of a resting order, or -1
+    int getSlot(int orderId) const;
+
     // Fills orders at currIdx up to orderSize. Returns next index to check if
     // the current idx is exhausted, otherwise returns the current idx.
     std::pair<int, int> fillOrdersAtCurrIdx(int currIdx, int orderSize);
 
+    // Shares orderSize (< the level's totalSize) among the orders at currIdx
+    // as Policy says, for a policy other than FIFO
+    void allocateAtCurrIdx(int currIdx, int orderSize);
+
+    // Fills qty of the order at slot and moves it to the done map (and its
+    // slot to the free list) if that completes it
+    void fillOrder(int currIdx, int slot, int qty);
+
+    // Scratch space for allocateAtCurrIdx, kept to avoid reallocating
+    std::vector<int> levelSizes, levelFills;
+
+    // Scratch space for cancelPriceRange: the next order of each level
+    std::vector<int> levelHeads;
+
     // Creates new bid or offer level at the provided newIdx.
     void addNewOrderLevel(int newIdx, bool isBid);
 
@@ -117,19 +275,35 @@ class OrderBook {
     void removeOrderLevel(int currIdx);
 
     // Determines if an existing level is a bid or offer level.
-    bool getIsBid(int currIdx);
+    bool getIsBid(int currIdx) const;
 
     // Determines if price and orderSize are valid
-    bool getIsOrderValid(int price, int orderSize);
+    bool getIsOrderValid(int price, int orderSize) const;
 };
 
-inline bool OrderBook::getIsBid(int currIdx) {
+template <typename Policy>
+inline bool BasicOrderBook<Policy>::getIsBid(int currIdx) const {
     // If lastBidIdx >= 0, then a bid is always less than last bid thus true
     // If lastBidIdx < 0, there were no bids to start thus false
     return currIdx <= lastBidIdx;
 }
 
-inline bool OrderBook::getIsOrderValid(int price, int orderSize) {
+template <typename Policy>
+inline int BasicOrderBook<Policy>::getSlot(int orderId) const {
+    return orderId > 0 && orderId < static_cast<int>(orderSlots.size())
+               ? orderSlots[orderId]
+               : -1;
+}
+
+template <typename Policy>
+inline bool BasicOrderBook<Policy>::getIsOrderValid(int price,
+                                                     int orderSize) const {
     return (price >= 0) && (price <= maxP) && (price % incr == 0) &&
            (orderSize > 0);
 }
+
+using OrderBook = BasicOrderBook<FifoMatching>;
+using ProRataOrderBook = BasicOrderBook<ProRataMatching>;
+using TopOrderOrderBook = BasicOrderBook<TopOrderMatching>;
+
+#endif  // ORDER_BOOK_H_
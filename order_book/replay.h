@@ -0,0 +1,245 @@
+/*
+    Replays a day of order events for many symbols, e.g. for a backtest, with
+   one OrderBook per symbol. Books for different symbols never interact, so
+   the work splits cleanly by symbol:
+   1) the events are partitioned by symbol, keeping each symbol's events in
+   file order (a stable partition, so per-symbol ordering is preserved),
+   2) each symbol is replayed as one job on a WorkerPool (see
+   ../task_scheduler/worker_pool.h), largest symbols first so that a big one
+   does not start last and hold up the end of the replay,
+   3) each job writes its outputs (fills, changes of L1) to its own vector, so
+   workers share nothing but the job queue,
+   4) the per-symbol outputs, each already in event order, are combined with
+   a k-way merge on (timestamp, position of the event in the file) using a
+   heap of one cursor per symbol.
+   The merged outputs are the same for any number of workers, including 0,
+   which replays on the calling thread.
+
+   Event file: an 8-byte magic number and a count followed by raw BookEvent
+   records (written with fwrite, in the spirit of schedule_log.h), in the
+   order they happened. A CANCEL or UPDATE refers to an order by the id that
+   its symbol's book gave it, which a replay reproduces as long as the book
+   sees the same events in the same order: the nth valid ADD of a symbol is
+   order n (an UPDATE keeps the order's id, even at a new price).
+*/
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../task_scheduler/worker_pool.h"
+#include "order_book.h"
+
+// SNAPSHOT_BID and SNAPSHOT_OFFER are levels of an L2 snapshot in a capture
+// (see capture.h), which a replay skips
+enum class EventType : int32_t {
+    ADD,
+    CANCEL,
+    UPDATE,
+    SNAPSHOT_BID,
+    SNAPSHOT_OFFER
+};
+
+struct BookEvent {
+    int64_t timestamp{0};
+    int32_t symbol{0};
+    EventType type{EventType::ADD};
+    int32_t orderId{0};  // CANCEL and UPDATE
+    int32_t price{0};    // ADD and UPDATE
+    int32_t size{0};     // ADD and UPDATE
+    int32_t isBid{0};    // ADD
+};
+
+struct ReplayOutput {
+    enum Kind : int32_t { FILL, TOP };
+    int64_t timestamp{0};
+    int64_t seq{0};  // position of the event in the file, breaks time ties
+    int32_t symbol{0};
+    Kind kind{FILL};
+    // FILL: the part of an added order that traded on arrival
+    int32_t orderId{0};
+    OrderState fill;
+    // TOP: the symbol's L1 after the event
+    L1_Data top;
+};
+
+struct ReplayOptions {
+    int maxPrice{1000};
+    int increment{1};
+    size_t numWorkers{0};  // 0 = on the calling thread
+};
+
+inline constexpr uint64_t EVENT_FILE_MAGIC = 0x31545645424f4351;
+
+inline bool writeEventFile(const std::string& path,
+                           const std::vector<BookEvent>& events) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    uint64_t n = events.size();
+    bool ok = std::fwrite(&EVENT_FILE_MAGIC, sizeof(uint64_t), 1, f) == 1 &&
+              std::fwrite(&n, sizeof(n), 1, f) == 1 &&
+              std::fwrite(events.data(), sizeof(BookEvent), n, f) == n;
+    return std::fclose(f) == 0 && ok;
+}
+
+// false if the file cannot be read or is not an event file, including when
+// it holds fewer events than its header says
+inline bool readEventFile(const std::string& path,
+                          std::vector<BookEvent>& events) {
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    uint64_t magic = 0, n = 0;
+    bool ok = std::fread(&magic, sizeof(magic), 1, f) == 1 &&
+              magic == EVENT_FILE_MAGIC &&
+              std::fread(&n, sizeof(n), 1, f) == 1;
+    if (ok) {
+        // n is whatever the file says, so it is checked against the bytes
+        // that follow before anything is allocated for it
+        long header = std::ftell(f);
+        ok = header >= 0 && std::fseek(f, 0, SEEK_END) == 0;
+        long size = ok ? std::ftell(f) : -1;
+        ok = ok && size >= header &&
+             n <= static_cast<uint64_t>(size - header) / sizeof(BookEvent) &&
+             std::fseek(f, header, SEEK_SET) == 0;
+    }
+    if (ok) {
+        events.resize(n);
+        ok = std::fread(events.data(), sizeof(BookEvent), n, f) == n;
+    }
+    std::fclose(f);
+    return ok;
+}
+
+// Applies an ADD, CANCEL or UPDATE to book (anything else is ignored).
+// Returns whether the book accepted it and, for an ADD, the new order's id.
+inline std::pair<bool, int> applyEvent(OrderBook& book, const BookEvent& e) {
+    switch (e.type) {
+        case EventType::ADD:
+            return book.addOrder(e.price, e.size, e.isBid != 0);
+        case EventType::CANCEL:
+            return {book.cancelOrder(e.orderId).first, e.orderId};
+        case EventType::UPDATE:
+            return {book.updateOrder(e.orderId, e.price, e.size).first,
+                    e.orderId};
+        default:
+            return {false, -1};
+    }
+}
+
+// Replays one symbol's events (in file order, seqs[i] being the position of
+// events[i] in the file) and appends its outputs
+inline void replaySymbol(const std::vector<BookEvent>& events,
+                         const std::vector<int64_t>& seqs,
+                         const ReplayOptions& options,
+                         std::vector<ReplayOutput>& outputs) {
+    OrderBook book(options.maxPrice, options.increment);
+    L1_Data top = book.getL1OrderData();
+    for (size_t i = 0; i < events.size(); ++i) {
+        const BookEvent& e = events[i];
+        ReplayOutput out;
+        out.timestamp = e.timestamp;
+        out.seq = seqs[i];
+        out.symbol = e.symbol;
+        auto [ok, orderId] = applyEvent(book, e);
+        if (ok && e.type == EventType::ADD) {
+            out.orderId = orderId;
+            out.fill = book.getOrderStatus(orderId).second;
+            if (out.fill.filledSize > 0) {
+                outputs.push_back(out);
+            }
+        }
+        L1_Data now = book.getL1OrderData();
+        if (now.bestBid.price != top.bestBid.price ||
+            now.bestBid.totalSize != top.bestBid.totalSize ||
+            now.bestOffer.price != top.bestOffer.price ||
+            now.bestOffer.totalSize != top.bestOffer.totalSize) {
+            top = now;
+            out.kind = ReplayOutput::TOP;
+            out.top = top;
+            outputs.push_back(out);
+        }
+    }
+}
+
+inline std::vector<ReplayOutput> replay(const std::vector<BookEvent>& events,
+                                        const ReplayOptions& options = {}) {
+    // 1) partition by symbol, in file order
+    std::unordered_map<int32_t, size_t> partitionOf;
+    std::vector<std::vector<BookEvent>> partitions;
+    std::vector<std::vector<int64_t>> seqs;
+    for (size_t i = 0; i < events.size(); ++i) {
+        auto [it, isNew] =
+            partitionOf.try_emplace(events[i].symbol, partitions.size());
+        if (isNew) {
+            partitions.emplace_back();
+            seqs.emplace_back();
+        }
+        partitions[it->second].push_back(events[i]);
+        seqs[it->second].push_back(static_cast<int64_t>(i));
+    }
+
+    // 2) and 3) one job per symbol, largest first
+    std::vector<size_t> order(partitions.size());
+    for (size_t p = 0; p < order.size(); ++p) {
+        order[p] = p;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return partitions[a].size() > partitions[b].size();
+    });
+    std::vector<std::vector<ReplayOutput>> outputs(partitions.size());
+    if (options.numWorkers == 0) {
+        for (size_t p : order) {
+            replaySymbol(partitions[p], seqs[p], options, outputs[p]);
+        }
+    } else {
+        WorkerPool pool(options.numWorkers);
+        for (size_t p : order) {
+            pool.submit([&, p]() {
+                replaySymbol(partitions[p], seqs[p], options, outputs[p]);
+            });
+        }
+    }  // the pool finishes every job before it goes away
+
+    // 4) k-way merge
+    using Cursor = std::pair<size_t, size_t>;  // partition, position in it
+    auto later = [&](const Cursor& a, const Cursor& b) {
+        const ReplayOutput& x = outputs[a.first][a.second];
+        const ReplayOutput& y = outputs[b.first][b.second];
+        return x.timestamp != y.timestamp ? x.timestamp > y.timestamp
+                                          : x.seq > y.seq;
+    };
+    std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heads(
+        later);
+    size_t total = 0;
+    for (size_t p = 0; p < outputs.size(); ++p) {
+        total += outputs[p].size();
+        if (!outputs[p].empty()) {
+            heads.push({p, 0});
+        }
+    }
+    std::vector<ReplayOutput> merged;
+    merged.reserve(total);
+    while (!heads.empty()) {
+        auto [p, i] = heads.top();
+        heads.pop();
+        merged.push_back(outputs[p][i]);
+        if (i + 1 < outputs[p].size()) {
+            heads.push({p, i + 1});
+        }
+    }
+    return merged;
+}
+
+#endif  // REPLAY_H_
@@ -0,0 +1,354 @@
+/*
+    Primary/backup replication of an OrderBook, so that a failover takes over
+   a hot standby instead of rebuilding a book from the start-of-day feed.
+
+   The primary (PrimaryBook) applies each command to its own book, and if the
+   book accepts it, appends it to a journal as a BookEvent (see replay.h).
+   Rejected commands change nothing, so they are not shipped. The journal goes
+   to the backup over a stream socket in batches, each with a header holding
+   the sequence number of its first command, the number of commands and the
+   primary's checksum after the batch (see OrderBook::getChecksum). The backup
+   (BackupBook) applies a batch on its own thread, checks that its checksum
+   matches, and acks with the sequence number of the last command it applied.
+   A mismatch means the two books diverged: the backup stops applying and
+   reports it, since a replica in that state is useless for failover.
+
+   Acknowledgement modes:
+   1) ASYNC: a batch is sent once batchSize commands are waiting or on
+   flush(), and acks are picked up without waiting whenever the primary
+   sends. Commands cost the primary little, but the last batch in flight can
+   be lost with the primary (getLag tells how many commands that is).
+   2) SYNC: every command is sent and acked before the call returns, so
+   nothing that the primary acknowledged can be missing on the backup, at
+   the cost of a round trip per command.
+   In ASYNC mode a slow backup eventually fills the socket buffer, and the
+   primary then blocks on send rather than falling further behind.
+
+   The socket can be either end of a socketpair (Unix domain), or a TCP
+   connection on loopback from listenLoopback, acceptConnection and
+   connectLoopback. Both classes take ownership of their descriptor.
+
+   Commands are limited to what a BookEvent holds: adds (without trader or
+   expiry time), cancels and updates. The primary's book is only exposed
+   const, so nothing else (mass cancels, advanceTime) can change it behind
+   the journal's back.
+*/
+
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "order_book.h"
+#include "replay.h"
+
+enum class AckMode { ASYNC, SYNC };
+
+struct ReplicationOptions {
+    AckMode ackMode{AckMode::ASYNC};
+    size_t batchSize{64};  // commands per batch in ASYNC mode
+};
+
+struct JournalBatchHeader {
+    uint64_t firstSeq{0};  // commands are numbered from 1
+    uint64_t numCommands{0};
+    uint64_t checksum{0};  // the primary's, after the batch
+};
+
+// Loopback TCP helpers; each returns a descriptor, or -1. Port 0 in
+// listenLoopback picks a free port, which getBoundPort returns.
+inline int listenLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr),
+                         sizeof(addr)) != 0 ||
+        ::listen(fd, 1) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+inline uint16_t getBoundPort(int listenFd) {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+    return ntohs(addr.sin_port);
+}
+
+inline int acceptConnection(int listenFd) {
+    return ::accept(listenFd, nullptr, nullptr);
+}
+
+inline int connectLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                            sizeof(addr)) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    int one = 1;  // batches are small and latency matters, esp. in SYNC
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Whole buffers, across short reads and writes. false on error or EOF.
+inline bool sendAll(int fd, const void* buf, size_t n) {
+    auto p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return false;
+        }
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+inline bool recvAll(int fd, void* buf, size_t n) {
+    auto p = static_cast<char*>(buf);
+    while (n > 0) {
+        ssize_t k = ::recv(fd, p, n, 0);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return false;
+        }
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+class PrimaryBook {
+   public:
+    PrimaryBook(int maxPrice, int increment, int fd,
+                ReplicationOptions options = {})
+        : book(maxPrice, increment), fd(fd), options(options) {
+        journal.reserve(options.batchSize);
+    }
+
+    // Sends what is left and tells the backup that the stream has ended
+    ~PrimaryBook() {
+        flush();
+        ::shutdown(fd, SHUT_WR);
+        ::close(fd);
+    }
+    PrimaryBook(const PrimaryBook& other) = delete;
+    PrimaryBook& operator=(const PrimaryBook& other) = delete;
+
+    // As OrderBook's, plus replication
+    std::pair<bool, int> addOrder(int price, int orderSize, bool isBid) {
+        auto result = book.addOrder(price, orderSize, isBid);
+        if (result.first) {
+            BookEvent e;
+            e.type = EventType::ADD;
+            e.price = price;
+            e.size = orderSize;
+            e.isBid = isBid;
+            record(e);
+        }
+        return result;
+    }
+
+    std::pair<bool, OrderState> cancelOrder(int orderId) {
+        auto result = book.cancelOrder(orderId);
+        if (result.first) {
+            BookEvent e;
+            e.type = EventType::CANCEL;
+            e.orderId = orderId;
+            record(e);
+        }
+        return result;
+    }
+
+    std::pair<bool, OrderState> updateOrder(int orderId, int newPrice,
+                                            int newSize) {
+        auto result = book.updateOrder(orderId, newPrice, newSize);
+        if (result.first) {
+            BookEvent e;
+            e.type = EventType::UPDATE;
+            e.orderId = orderId;
+            e.price = newPrice;
+            e.size = newSize;
+            record(e);
+        }
+        return result;
+    }
+
+    // Queries go straight to the book. It is const so that every change
+    // goes through the methods above and thus into the journal.
+    const OrderBook& getBook() const { return book; }
+
+    // Sends the waiting commands, if any, and picks up acks. false if the
+    // backup is gone (replication then stops).
+    bool flush() {
+        if (!isConnected || journal.empty()) {
+            return isConnected;
+        }
+        JournalBatchHeader header{sentSeq + 1, journal.size(),
+                                  book.getChecksum()};
+        isConnected =
+            sendAll(fd, &header, sizeof(header)) &&
+            sendAll(fd, journal.data(), journal.size() * sizeof(BookEvent));
+        sentSeq += journal.size();
+        journal.clear();
+        readAcks(false);
+        return isConnected;
+    }
+
+    // Blocks until the backup has acked every command sent so far
+    bool waitForAcks() {
+        while (isConnected && ackedSeq < sentSeq) {
+            readAcks(true);
+        }
+        return isConnected;
+    }
+
+    // Commands accepted here but not acked by the backup yet
+    uint64_t getLag() const { return sentSeq + journal.size() - ackedSeq; }
+    bool getIsConnected() const { return isConnected; }
+
+   private:
+    void record(const BookEvent& e) {
+        journal.push_back(e);
+        if (options.ackMode == AckMode::SYNC) {
+            flush();
+            waitForAcks();
+        } else if (journal.size() >= options.batchSize) {
+            flush();
+        }
+    }
+
+    // Reads the acks that have arrived, or waits for at least one
+    void readAcks(bool wait) {
+        uint64_t seq;
+        while (true) {
+            ssize_t k = ::recv(fd, &seq, sizeof(seq),
+                               wait ? MSG_PEEK : MSG_PEEK | MSG_DONTWAIT);
+            if (k < 0 && errno == EINTR) {
+                continue;
+            }
+            if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;  // none yet
+            }
+            if (k <= 0 || !recvAll(fd, &seq, sizeof(seq))) {
+                isConnected = false;
+                return;
+            }
+            ackedSeq = seq;
+            wait = false;  // got one, take the rest without waiting
+        }
+    }
+
+    OrderBook book;
+    int fd;
+    ReplicationOptions options;
+    std::vector<BookEvent> journal;  // accepted, not sent yet
+    uint64_t sentSeq{0};
+    uint64_t ackedSeq{0};
+    bool isConnected{true};
+};
+
+class BackupBook {
+   public:
+    // Starts applying the primary's journal right away
+    BackupBook(int maxPrice, int increment, int fd)
+        : book(maxPrice, increment), fd(fd) {
+        applier = std::thread(&BackupBook::runApplier, this);
+    }
+
+    ~BackupBook() {
+        ::shutdown(fd, SHUT_RDWR);  // in case the primary is still there
+        if (applier.joinable()) {
+            applier.join();
+        }
+        ::close(fd);
+    }
+    BackupBook(const BackupBook& other) = delete;
+    BackupBook& operator=(const BackupBook& other) = delete;
+
+    // Failover: waits for the primary's stream to end (or break) and hands
+    // over the book, which then has every command the backup acked
+    OrderBook& promote() {
+        if (applier.joinable()) {
+            applier.join();
+        }
+        return book;
+    }
+
+    uint64_t getAppliedSeq() const {
+        return appliedSeq.load(std::memory_order_acquire);
+    }
+    bool getHasDiverged() const {
+        return hasDiverged.load(std::memory_order_acquire);
+    }
+
+   private:
+    // Whichever way applying stops, the socket is shut down, so that a
+    // primary waiting for an ack or blocked on send sees the backup go
+    // (EOF or EPIPE) instead of waiting forever
+    void runApplier() {
+        applyJournal();
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    // Until the stream ends or breaks, or the books diverge
+    void applyJournal() {
+        JournalBatchHeader header;
+        std::vector<BookEvent> batch;
+        while (recvAll(fd, &header, sizeof(header))) {
+            batch.resize(header.numCommands);
+            if (!recvAll(fd, batch.data(), batch.size() * sizeof(BookEvent))) {
+                return;
+            }
+            for (const BookEvent& e : batch) {
+                applyEvent(book, e);
+            }
+            if (book.getChecksum() != header.checksum) {
+                hasDiverged.store(true, std::memory_order_release);
+                return;
+            }
+            uint64_t seq = header.firstSeq + header.numCommands - 1;
+            appliedSeq.store(seq, std::memory_order_release);
+            if (!sendAll(fd, &seq, sizeof(seq))) {
+                return;
+            }
+        }
+    }
+
+    OrderBook book;  // only touched by the applier until it is joined
+    int fd;
+    std::atomic<uint64_t> appliedSeq{0};
+    std::atomic<bool> hasDiverged{false};
+    std::thread applier;
+};
+
+#endif  // REPLICATION_H_
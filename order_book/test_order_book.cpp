@@ -1,3 +1,500 @@
-# include "order_book.h"
-// TODO: Just to make the code compile for now
-int main() {}
\ No newline at end of file
+/*
+Compile with
+g20 -pthread order_book.cpp test_order_book.cpp -o ../bin/order_book
+*/
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "capture.h"
+#include "linked_books.h"
+#include "order_book.h"
+#include "replay.h"
+#include "replication.h"
+
+void testGoodTillTime() {
+    OrderBook book(1000, 1, 10);  // wheel slots of 10 time units
+    auto [ok1, dayBid] = book.addOrder(100, 5, true);
+    auto [ok2, gttBid] = book.addOrder(100, 3, true, 50);
+    auto [ok3, gttOffer] = book.addOrder(110, 4, false, 20000);  // > 1 turn
+    auto [ok4, filledOffer] = book.addOrder(105, 2, false, 30);
+    bool rejected = !book.addOrder(100, 1, true, 0).first;
+    assert(ok1 && ok2 && ok3 && ok4 && rejected);  // already expired
+
+    // the offer at 105 is filled before it would expire
+    bool ok5 = book.addOrder(105, 2, true).first;
+    int numExpired = book.advanceTime(49);
+    assert(ok5 && numExpired == 0);
+    assert(book.getL1OrderData().bestBid.totalSize == 8);
+
+    numExpired = book.advanceTime(50);
+    assert(numExpired == 1);
+    assert(!book.getOrderStatus(gttBid).first);
+    assert(book.getOrderStatus(dayBid).first);
+    assert(book.getL1OrderData().bestBid.totalSize == 5);
+
+    // passed over once per turn of the wheel until it is due
+    numExpired = book.advanceTime(19999);
+    assert(numExpired == 0);
+    assert(book.getOrderStatus(gttOffer).first);
+    numExpired = book.advanceTime(1000000);
+    assert(numExpired == 1);
+    assert(book.getL1OrderData().bestOffer.price == -1);
+    assert(!book.getOrderStatus(filledOffer).first);
+    assert(book.getOrderStatus(filledOffer).second.filledSize == 2);
+    std::cout << "Good-till-time orders expired with the book's clock"
+              << std::endl;
+}
+
+void testMassCancel() {
+    OrderBook book(1000, 5);
+    int alice = 1, bob = 2;
+    for (int price = 100; price <= 150; price += 5) {
+        book.addOrder(price, 10, true, -1, price % 10 == 0 ? alice : bob);
+        book.addOrder(price + 100, 10, false, -1, bob);
+    }
+    auto [ok, aliceOffer] = book.addOrder(300, 1, false, -1, alice);
+
+    int numCancelled = book.cancelTraderOrders(alice);
+    assert(ok && numCancelled == 7);
+    assert(!book.getOrderStatus(aliceOffer).first);
+    assert(book.getL2OrderData().bids.size() == 5);  // 105, 115, ... 145
+
+    // bids 115 to 135 go, leaving 105 and 145 linked to each other
+    numCancelled = book.cancelPriceRange(true, 111, 139);
+    assert(numCancelled == 3);
+    auto bids = book.getL2OrderData().bids;
+    assert(bids.size() == 2 && bids[0].price == 145 && bids[1].price == 105);
+    ok = book.addOrder(125, 1, true).first;  // relinks in the middle
+    assert(ok && book.getL2OrderData().bids.size() == 3);
+
+    // the best offers go, then the rest of the side
+    numCancelled = book.cancelPriceRange(false, 0, 219);
+    assert(numCancelled == 4);
+    assert(book.getL1OrderData().bestOffer.price == 220);
+    numCancelled = book.cancelSide(false);
+    assert(numCancelled == 7);
+    assert(book.getL1OrderData().bestOffer.price == -1);
+    numCancelled = book.cancelTraderOrders(bob);
+    assert(numCancelled == 2);
+    assert(book.getL2OrderData().bids.size() == 1);
+    numCancelled = book.cancelTraderOrders(alice);
+    assert(numCancelled == 0);
+
+    // a range below 0 is empty rather than rounded up to price 0
+    book.addOrder(0, 1, true);
+    numCancelled = book.cancelPriceRange(true, -4, -1);
+    assert(numCancelled == 0);
+
+    // most of a book goes in one pass over its pool, the rest stays linked
+    OrderBook swept(1000, 1);
+    for (int price = 100; price < 110; ++price) {
+        swept.addOrder(price, 10, true, -1, alice);
+    }
+    numCancelled = swept.cancelPriceRange(true, 101, 200);
+    assert(numCancelled == 9);
+    numCancelled = swept.cancelTraderOrders(alice);
+    assert(numCancelled == 1);
+    assert(swept.getChecksum() == swept.computeChecksum());
+    std::cout << "Orders were cancelled by trader, side and price range"
+              << std::endl;
+}
+
+void testQueuePosition() {
+    OrderBook book(1000, 1);
+    int us = 7;
+    book.watchTrader(us);
+    auto [ok1, first] = book.addOrder(100, 5, true);
+    auto [ok2, ours] = book.addOrder(100, 3, true, -1, us);
+    auto [ok3, middle] = book.addOrder(100, 4, true);
+    auto [ok4, oursBehind] = book.addOrder(100, 2, true, -1, us);
+    book.addOrder(100, 6, true);
+    assert(ok1 && ok2 && ok3 && ok4);
+    assert(book.getQueuePosition(ours).second == 5);
+    assert(book.getQueuePosition(oursBehind).second == 12);
+    assert(book.getQueuePosition(middle).second == 8);  // by walking
+
+    // fills come off the front, cancels and resizes from anywhere
+    book.addOrder(100, 2, false);
+    assert(book.getQueuePosition(ours).second == 3);
+    book.updateOrder(first, 100, 4);  // 2 of 4 filled, 2 left
+    assert(book.getQueuePosition(ours).second == 2);
+    book.cancelOrder(middle);
+    assert(book.getQueuePosition(oursBehind).second == 5);
+    book.updateOrder(ours, 100, 1);
+    assert(book.getQueuePosition(oursBehind).second == 3);
+    book.addOrder(100, 2, false);  // takes what is left of first
+    assert(book.getQueuePosition(ours).second == 0);
+    assert(book.getQueuePosition(oursBehind).second == 1);
+
+    // a partly filled order at the front has nothing ahead of it
+    book.addOrder(100, 1, false);
+    book.addOrder(100, 1, false);
+    assert(!book.getQueuePosition(ours).first);
+    assert(book.getQueuePosition(oursBehind) == std::make_pair(true, 0));
+
+    // a new price puts an order at the back of its new level
+    book.addOrder(101, 4, true);
+    book.updateOrder(oursBehind, 101, 2);
+    assert(book.getQueuePosition(oursBehind).second == 4);
+    std::cout << "Queue positions were kept up to date" << std::endl;
+}
+
+void testProRata() {
+    ProRataOrderBook book(1000, 1);
+    book.watchTrader(7);
+    int a = book.addOrder(100, 10, true).second;
+    int b = book.addOrder(100, 20, true).second;
+    int c = book.addOrder(100, 30, true, -1, 7).second;
+
+    // 25 of 60: 4.2, 8.3 and 12.5 round down to 4, 8 and 12, and the lot
+    // left over goes to the oldest order
+    book.addOrder(100, 25, false);
+    assert(book.getOrderStatus(a).second.filledSize == 5);
+    assert(book.getOrderStatus(b).second.filledSize == 8);
+    assert(book.getOrderStatus(c).second.filledSize == 12);
+    assert(book.getQueuePosition(c).second == 17);
+    assert(book.getL1OrderData().bestBid.totalSize == 35);
+
+    // taking out the level fills everyone and rests the rest
+    book.addOrder(100, 40, false);
+    assert(!book.getOrderStatus(c).first);
+    assert(book.getL1OrderData().bestOffer.totalSize == 5);
+
+    TopOrderOrderBook top(1000, 1);
+    a = top.addOrder(100, 10, true).second;
+    b = top.addOrder(100, 20, true).second;
+    c = top.addOrder(100, 30, true).second;
+    top.addOrder(100, 5, false);  // all to the top order
+    assert(top.getOrderStatus(a).second.filledSize == 5);
+    top.addOrder(100, 20, false);  // 5 to the top order, 15 pro rata
+    assert(!top.getOrderStatus(a).first);
+    assert(top.getOrderStatus(b).second.filledSize == 6);
+    assert(top.getOrderStatus(c).second.filledSize == 9);
+    std::cout << "Pro-rata and top order books shared fills as expected"
+              << std::endl;
+}
+
+void testImpliedSpread() {
+    LinkedBooks books(1000, 1);
+    using L = LinkedBooks;
+    books.addOrder(L::FRONT, 101, 5, false);  // front offer
+    books.addOrder(L::BACK, 98, 3, true);     // back bid
+    books.addOrder(L::BACK, 99, 2, true);
+    auto implied = books.getImpliedPrices();
+    assert(implied.spreadOffer.price == 2);  // 101 - 99
+    assert(implied.spreadOffer.totalSize == 2);
+    assert(implied.spreadBid.totalSize <= 0);
+
+    // deeper orders leave the tops, and so the implied prices, alone
+    int64_t updates = books.getNumImpliedUpdates();
+    books.addOrder(L::FRONT, 105, 5, false);
+    books.addOrder(L::BACK, 90, 5, true);
+    assert(books.getNumImpliedUpdates() == updates);
+
+    // a direct spread offer at 4 is worse than the implied 2 and 3
+    books.addOrder(L::SPREAD, 4, 10, false);
+    auto [ok, fill] = books.addSpreadOrder(3, 6, true);
+    assert(ok && fill.filledSize == 5 && fill.impliedSize == 5);
+    assert(fill.filledValue == 2 * 2 + 3 * 3 && fill.restingId > 0);
+    auto frontTop = books.getBook(L::FRONT).getL1OrderData().bestOffer;
+    assert(frontTop.price == 105);  // 101 was lifted by the spread
+    auto backTop = books.getBook(L::BACK).getL1OrderData().bestBid;
+    assert(backTop.price == 90);    // and 99 and 98 were hit
+
+    // the resting spread bid at 3 and the back bid imply a front bid
+    implied = books.getImpliedPrices();
+    assert(implied.frontBid.price == 93 && implied.frontBid.totalSize == 1);
+
+    // filled in full by the direct offer at 4, so nothing rests to have an id
+    auto [filled, noId] = books.addOrder(L::SPREAD, 4, 1, true);
+    assert(filled && noId == -1);
+    ok = books.addSpreadOrder(-1001, 1, true).first;
+    assert(!ok);
+    std::cout << "Spread orders traded against implied prices" << std::endl;
+}
+
+// A day of events over numSymbols symbols, interleaved, with every book
+// crossing often enough to trade
+std::vector<BookEvent> makeEvents(int numEvents, int numSymbols) {
+    std::vector<BookEvent> events;
+    std::vector<int> numAdds(numSymbols, 0);
+    uint32_t rand = 12345;
+    for (int i = 0; i < numEvents; ++i) {
+        rand = rand * 1103515245 + 12345;
+        BookEvent e;
+        e.timestamp = i / 3;  // ties across symbols
+        e.symbol = rand % numSymbols;
+        int& adds = numAdds[e.symbol];
+        if (adds > 0 && (rand >> 8) % 4 == 0) {
+            e.type = (rand >> 12) % 2 ? EventType::CANCEL : EventType::UPDATE;
+            e.orderId = 1 + (rand >> 14) % adds;
+            e.price = 95 + (rand >> 20) % 10;
+            e.size = 1 + (rand >> 24) % 10;
+        } else {
+            e.price = 95 + (rand >> 20) % 10;
+            e.size = 1 + (rand >> 24) % 10;
+            e.isBid = (rand >> 16) % 2;
+            ++adds;
+        }
+        events.push_back(e);
+    }
+    return events;
+}
+
+void testParallelReplay() {
+    // the ids makeEvents counts on: an update to a new price keeps its id
+    OrderBook book(1000, 1);
+    int first = book.addOrder(100, 5, true).second;
+    bool updated = book.updateOrder(first, 101, 5).first;
+    int second = book.addOrder(90, 5, true).second;
+    assert(updated && first == 1 && second == 2);
+    assert(book.getOrderStatus(first).first);
+
+    auto events = makeEvents(20000, 40);
+    const char* path = "/tmp/test_order_book.events";
+    bool written = writeEventFile(path, events);
+    std::vector<BookEvent> read;
+    bool wasRead = readEventFile(path, read);
+    assert(written && wasRead && read.size() == events.size());
+
+    // a count beyond the end of the file is refused, not allocated
+    FILE* f = std::fopen(path, "r+b");
+    uint64_t tooMany = uint64_t{1} << 60;
+    bool patched = f && std::fseek(f, sizeof(uint64_t), SEEK_SET) == 0 &&
+                   std::fwrite(&tooMany, sizeof(tooMany), 1, f) == 1;
+    if (f) {
+        std::fclose(f);
+    }
+    std::vector<BookEvent> bogus;
+    bool bogusRead = readEventFile(path, bogus);
+    assert(patched && !bogusRead);
+    std::remove(path);
+
+    auto serial = replay(read);
+    auto parallel = replay(read, {1000, 1, 4});
+    assert(!serial.empty() && serial.size() == parallel.size());
+    bool hasFill = false;
+    for (size_t i = 0; i < serial.size(); ++i) {
+        assert(serial[i].seq == parallel[i].seq);
+        assert(serial[i].kind == parallel[i].kind);
+        assert(serial[i].fill.filledSize == parallel[i].fill.filledSize);
+        assert(serial[i].top.bestBid.price == parallel[i].top.bestBid.price);
+        if (i > 0) {  // merged by time, then by position in the file
+            assert(serial[i - 1].timestamp < serial[i].timestamp ||
+                   (serial[i - 1].timestamp == serial[i].timestamp &&
+                    serial[i - 1].seq <= serial[i].seq));
+        }
+        hasFill = hasFill || serial[i].kind == ReplayOutput::FILL;
+    }
+    assert(hasFill);
+    std::cout << "Replay on 4 workers matched the serial replay" << std::endl;
+}
+
+void testCapture() {
+    auto events = makeEvents(20000, 40);
+    OrderBook book(1000, 1);
+    book.addOrder(99, 5, true);
+    book.addOrder(101, 7, false);
+    const char* path = "/tmp/test_order_book.capture";
+    {
+        CaptureWriter writer(path, 1000);
+        assert(writer.getIsOpen());
+        for (const auto& e : events) {
+            writer.append(e);
+        }
+        writer.appendSnapshot(events.back().timestamp, 3,
+                              book.getL2OrderData());
+        bool closed = writer.close();
+        assert(closed);
+
+        // once closed, or if never open, nothing is queued any more
+        size_t numAllocated = writer.getNumAllocatedBlocks();
+        CaptureWriter nowhere("/tmp/no_such_dir/capture", 1000);
+        for (const auto& e : events) {
+            writer.append(e);
+            nowhere.append(e);
+        }
+        assert(writer.getNumAllocatedBlocks() == numAllocated);
+        assert(!nowhere.getIsOpen() && nowhere.getNumAllocatedBlocks() == 0);
+    }
+    CaptureReader reader(path);
+    assert(reader.getIsOpen() && reader.getBlocks().size() == 21);
+    std::FILE* f = std::fopen(path, "rb");
+    std::fseek(f, 0, SEEK_END);
+    long bytes = std::ftell(f);
+    std::fclose(f);
+    std::remove(path);
+    assert(bytes * 4 < static_cast<long>(events.size() * sizeof(BookEvent)));
+
+    auto same = [](const BookEvent& a, const BookEvent& b) {
+        return a.timestamp == b.timestamp && a.symbol == b.symbol &&
+               a.type == b.type && a.orderId == b.orderId &&
+               a.price == b.price && a.size == b.size && a.isBid == b.isBid;
+    };
+    std::vector<BookEvent> all;
+    reader.read(0, events.back().timestamp, all);
+    assert(all.size() == events.size() + 2);
+    for (size_t i = 0; i < events.size(); ++i) {
+        assert(same(all[i], events[i]));
+    }
+    assert(all.back().type == EventType::SNAPSHOT_OFFER &&
+           all.back().price == 101 && all.back().size == 7);
+
+    // events 6000 to 8999, exactly blocks 6 to 8
+    std::vector<BookEvent> range;
+    size_t numBlocks = reader.read(2000, 2999, range);
+    assert(numBlocks == 3);
+    assert(range.size() == 3000 && same(range.front(), events[6000]));
+    assert(!CaptureReader("/tmp/no_such_capture").getIsOpen());
+    std::cout << "Capture was read back by time range" << std::endl;
+}
+
+void testChecksum() {
+    // the same resting orders, reached in different ways
+    OrderBook a(1000, 1), b(1000, 1);
+    a.addOrder(100, 5, true);
+    a.addOrder(99, 3, true);
+    b.addOrder(100, 8, true);
+    b.addOrder(99, 3, true);
+    assert(a.getChecksum() != b.getChecksum());
+    b.updateOrder(1, 100, 5);
+    assert(a.getChecksum() == b.getChecksum());
+    a.addOrder(100, 1, false);  // a fill changes it too
+    assert(a.getChecksum() != b.getChecksum());
+
+    // the same id, price and size on the other side
+    OrderBook bid(1000, 1), offer(1000, 1);
+    bid.addOrder(100, 5, true);
+    offer.addOrder(100, 5, false);
+    assert(bid.getChecksum() != offer.getChecksum());
+
+    // kept up to date through every kind of change
+    OrderBook book(1000, 1);
+    ProRataOrderBook proRata(1000, 1);
+    int i = 0;
+    for (const auto& e : makeEvents(5000, 1)) {
+        if (e.type == EventType::ADD) {
+            book.addOrder(e.price, e.size, e.isBid, -1, i % 3);
+            proRata.addOrder(e.price, e.size, e.isBid);
+        } else if (e.type == EventType::CANCEL) {
+            book.cancelOrder(e.orderId);
+            proRata.cancelOrder(e.orderId);
+        } else {
+            book.updateOrder(e.orderId, e.price, e.size);
+            proRata.updateOrder(e.orderId, e.price, e.size);
+        }
+        if (++i % 1000 == 0) {
+            book.cancelTraderOrders(1);
+            book.cancelPriceRange(true, 96, 97);
+        }
+        assert(book.getChecksum() == book.computeChecksum());
+        assert(proRata.getChecksum() == proRata.computeChecksum());
+    }
+    book.cancelSide(true);
+    book.cancelSide(false);
+    assert(book.getChecksum() == 0);
+    std::cout << "Book checksums were kept up to date" << std::endl;
+}
+
+void testReplication() {
+    // SYNC over a socketpair: acked before each call returns
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::perror("socketpair");
+        std::exit(1);
+    }
+    BackupBook backup(1000, 1, fds[1]);
+    uint64_t checksum = 0;
+    {
+        PrimaryBook primary(1000, 1, fds[0], {AckMode::SYNC});
+        auto [ok, bid] = primary.addOrder(100, 5, true);
+        bool rejected = !primary.addOrder(100, 0, true).first;  // not shipped
+        assert(ok && rejected);
+        assert(backup.getAppliedSeq() == 1 && primary.getLag() == 0);
+        primary.addOrder(99, 3, false);  // trades with the bid
+        primary.updateOrder(bid, 98, 10);
+        assert(backup.getAppliedSeq() == 3);
+        checksum = primary.getBook().getChecksum();
+    }
+    OrderBook& promoted = backup.promote();
+    assert(!backup.getHasDiverged());
+    assert(promoted.getChecksum() == checksum);
+    assert(promoted.getL1OrderData().bestBid.price == 98);
+
+    // ASYNC over loopback TCP, in batches
+    int listenFd = listenLoopback(0);
+    if (listenFd < 0) {
+        std::perror("listen");
+        std::exit(1);
+    }
+    int clientFd = connectLoopback(getBoundPort(listenFd));
+    BackupBook tcpBackup(1000, 1, acceptConnection(listenFd));
+    ::close(listenFd);
+    {
+        PrimaryBook primary(1000, 1, clientFd, {AckMode::ASYNC, 16});
+        for (const auto& e : makeEvents(2000, 1)) {
+            if (e.type == EventType::ADD) {
+                primary.addOrder(e.price, e.size, e.isBid);
+            } else if (e.type == EventType::CANCEL) {
+                primary.cancelOrder(e.orderId);
+            } else {
+                primary.updateOrder(e.orderId, e.price, e.size);
+            }
+        }
+        bool flushed = primary.flush();
+        bool acked = primary.waitForAcks();
+        assert(flushed && acked);
+        assert(primary.getLag() == 0);
+        assert(tcpBackup.getAppliedSeq() > 1000);
+        checksum = primary.getBook().getChecksum();
+    }
+    assert(tcpBackup.promote().getChecksum() == checksum);
+    assert(!tcpBackup.getHasDiverged());
+
+    // a batch that leaves the books different is caught
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::perror("socketpair");
+        std::exit(1);
+    }
+    BackupBook diverged(1000, 1, fds[1]);
+    JournalBatchHeader header{1, 1, 12345};
+    BookEvent add;
+    add.price = 100;
+    add.size = 1;
+    bool sent = sendAll(fds[0], &header, sizeof(header)) &&
+                sendAll(fds[0], &add, sizeof(add));
+    assert(sent);
+    ::close(fds[0]);
+    diverged.promote();
+    assert(diverged.getHasDiverged() && diverged.getAppliedSeq() == 0);
+
+    // a SYNC primary is not left waiting for the ack of a diverged backup
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::perror("socketpair");
+        std::exit(1);
+    }
+    {
+        PrimaryBook primary(1000, 1, fds[0], {AckMode::SYNC});
+        BackupBook narrow(100, 1, fds[1]);  // rejects the add at 500
+        bool added = primary.addOrder(500, 5, true).first;
+        assert(added && !primary.getIsConnected());
+        assert(narrow.getHasDiverged());
+    }
+    std::cout << "Backups followed their primaries" << std::endl;
+}
+
+int main() {
+    testGoodTillTime();
+    testMassCancel();
+    testQueuePosition();
+    testProRata();
+    testImpliedSpread();
+    testParallelReplay();
+    testCapture();
+    testChecksum();
+    testReplication();
+}
@@ -0,0 +1,411 @@
+/*
+Compile with
+g20 -O2 -pthread task_scheduler.h bench_task_scheduler.cpp -o ../bin/bench_task_scheduler
+
+Run with no arguments for every benchmark, or with the names of some (e.g.
+"bench_task_scheduler latency schedule_cancel"). Every result is one JSON
+object per line, tagged with "bench" and all of its parameters, and the first
+line describes the machine, so two runs can be diffed line by line. Nothing
+is random: the workloads and their sizes are fixed.
+
+Heartbeat workload: many repeated tasks with the same interval whose start
+times are spread evenly across the interval (i.e. a few hundred us apart). We
+run it with increasing slack and report wakeups per second and CPU time, one
+JSON object per line.
+
+Fork-join: one scheduled task runs parallelFor over a large array with
+decreasing grain sizes; the time per piece compared with the serial loop is
+the overhead of spawning, popping and stealing.
+
+Sharded scheduling: P producer threads each schedule many tasks (far enough in
+the future that none runs) into one scheduler, then into a sharded scheduler
+with one shard per core. Ideally the sharded throughput scales with P. The
+schedulers run long enough to accept every task; "refused" counts those that
+were not, and must be 0 for the rates to mean anything.
+
+Recurrence: the cost of computing the next fire time of a calendar rule, from
+random points in time (including nights, weekends and holidays).
+
+Allocations: operator new is replaced to count every allocation in the
+process. After a warm-up, each round schedules tasks that run right away and
+tasks that are deleted before they are due; in steady state, neither the
+producer nor the event loop should allocate at all.
+
+Schedule/cancel: P producer threads (1 to 64) each schedule a task far in the
+future and delete it right away, over and over; reports pairs per second.
+Every pair takes q_mutex twice, so this is the lock's throughput under
+contention. As for the sharded bench, "refused" and "not_deleted" count the
+calls that failed, and must be 0.
+
+Latency and jitter: a fixed train of timers, each recording how long after
+its start_time it started, first on an idle scheduler and then while L
+threads keep scheduling and cancelling. Reports exact percentiles (not the
+histogram's buckets) and the standard deviation. The timers are further
+apart than MIN_DURATION, since a task due that soon after a wakeup runs
+early, in that wakeup.
+
+Pending timers: the heap bytes in use per queued task (via mallinfo2), and
+the wakeups per second of a scheduler holding many timers that are not due
+(ideally zero).
+*/
+
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <set>
+
+#include "sharded_scheduler.h"
+#include "task_scheduler.h"
+using namespace std::chrono_literals;
+
+std::atomic<uint64_t> num_allocations{0};
+
+// Not inlined, or GCC sees new and delete as malloc and free and warns about
+// every delete of a new
+[[gnu::noinline]] void* operator new(size_t size) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+double getCpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto to_s = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec * 1e-6; };
+    return to_s(usage.ru_utime) + to_s(usage.ru_stime);
+}
+
+void benchHeartbeats(int num_heartbeats, ns::milliseconds interval,
+                     ns::milliseconds slack, ns::milliseconds duration) {
+    auto start = ns::system_clock::now();
+    double cpu_before = getCpuSeconds();
+    MetricsSnapshot m;
+    {
+        TaskScheduler TS(start, {.max_duration = duration, .verbose = false});
+        std::this_thread::sleep_until(start + 10ms);  // let the loop start
+        for (int i = 0; i < num_heartbeats; ++i) {
+            auto offset = interval * i / num_heartbeats;
+            TS.scheduleRepeated(start + 50ms + offset, interval, 0ms, slack);
+        }
+        std::this_thread::sleep_until(start + duration - 10ms);
+        m = TS.getMetricsSnapshot();
+    }
+    double cpu_seconds = getCpuSeconds() - cpu_before;
+    double seconds = ns::duration<double>(duration).count();
+    std::cout << "{\"bench\":\"heartbeats\",\"num_heartbeats\":"
+              << num_heartbeats << ",\"interval_ms\":" << interval.count()
+              << ",\"slack_ms\":" << slack.count()
+              << ",\"wakeups_per_s\":" << m.wakeups / seconds
+              << ",\"tasks_per_s\":" << m.tasks_run / seconds
+              << ",\"cpu_s\":" << cpu_seconds
+              << ",\"lateness_p99_ns\":" << m.lateness.getPercentileNs(0.99)
+              << "}" << std::endl;
+}
+
+void benchParallelFor(size_t num_workers, size_t grain) {
+    constexpr size_t N = 1 << 22;
+    std::vector<double> v(N, 1.0);
+    auto work = [&](size_t i) { v[i] = v[i] * 1.0001 + 0.5; };
+    auto start = ns::system_clock::now();
+    TaskFuture<double> elapsed;
+    {
+        TaskScheduler TS(start, {.max_duration = 2000ms,
+                                 .num_workers = num_workers,
+                                 .verbose = false});
+        elapsed = TS.scheduleTask(start + 10ms, [&]() {
+            auto t0 = ns::steady_clock::now();
+            parallelFor(0, N, work, grain);
+            return ns::duration<double>(ns::steady_clock::now() - t0).count();
+        });
+    }
+    double seconds = elapsed.get();
+    std::cout << "{\"bench\":\"parallel_for\",\"num_workers\":" << num_workers
+              << ",\"grain\":" << grain << ",\"pieces\":" << N / grain
+              << ",\"seconds\":" << seconds
+              << ",\"ns_per_piece\":" << seconds * 1e9 / (N / grain) << "}"
+              << std::endl;
+}
+
+// Long enough for num_tasks schedule calls at 100K/s, an order of magnitude
+// below what one core does, so that the loop does not shut down (and refuse
+// the rest) before the producers are done. The destructor then waits out the
+// rest of it.
+ns::milliseconds getRunDuration(int64_t num_tasks) {
+    return 200ms + ns::milliseconds{num_tasks / 100};
+}
+
+// Returns scheduled tasks per second across all producers
+template <typename Schedule>
+double runProducers(size_t num_producers, int tasks_per_producer,
+                    Schedule schedule) {
+    auto t0 = ns::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < num_producers; ++p) {
+        producers.emplace_back([&]() {
+            for (int i = 0; i < tasks_per_producer; ++i) {
+                schedule(i);
+            }
+        });
+    }
+    for (auto& p : producers) {
+        p.join();
+    }
+    double seconds = ns::duration<double>(ns::steady_clock::now() - t0).count();
+    return num_producers * tasks_per_producer / seconds;
+}
+
+void benchSharded(size_t num_producers) {
+    constexpr int TASKS_PER_PRODUCER = 200000;
+    SchedulerOptions opts{
+        .max_duration = getRunDuration(num_producers * TASKS_PER_PRODUCER),
+        .verbose = false};
+    auto start = ns::system_clock::now();
+    auto later = start + 3600s;
+    double single = 0, sharded = 0;
+    std::atomic<int> refused{0};  // should stay 0, or the rate is inflated
+    {
+        TaskScheduler TS(start, opts);
+        single = runProducers(num_producers, TASKS_PER_PRODUCER, [&](int i) {
+            if (TS.scheduleTask(later + ns::milliseconds{i}, 0ms) < 0) {
+                ++refused;
+            }
+        });
+    }
+    start = ns::system_clock::now();
+    {
+        ShardedScheduler SS(start, num_producers, opts);
+        sharded = runProducers(num_producers, TASKS_PER_PRODUCER, [&](int i) {
+            if (SS.scheduleTask(later + ns::milliseconds{i}, 0ms) < 0) {
+                ++refused;
+            }
+        });
+    }
+    std::cout << "{\"bench\":\"sharded\",\"num_producers\":" << num_producers
+              << ",\"single_tasks_per_s\":" << single
+              << ",\"sharded_tasks_per_s\":" << sharded
+              << ",\"refused\":" << refused << "}" << std::endl;
+}
+
+void benchRecurrence() {
+    using namespace std::chrono;
+    auto cal = std::make_shared<TradingCalendar>(
+        2026y / 1 / 1, 2035y / 12 / 31,
+        std::vector<year_month_day>{2026y / 12 / 25, 2027y / 1 / 1});
+    auto rule = RecurrenceRule::everyDuringSessions(5min, {{9h + 30min, 16h}},
+                                                    cal, -5h);
+    constexpr int N = 1000000;
+    auto from = sys_days(2026y / 1 / 1);
+    int64_t sum = 0;  // keeps the calls from being optimized away
+    auto t0 = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        auto t = from + minutes{(i * 7919LL) % (3650LL * 1440)};
+        auto next = rule->getNextFire(t).time_since_epoch();
+        sum += duration_cast<minutes>(next).count() % 7;
+    }
+    double seconds = duration<double>(steady_clock::now() - t0).count();
+    std::cout << "{\"bench\":\"recurrence\",\"ns_per_next_fire\":"
+              << seconds * 1e9 / N << ",\"checksum\":" << sum << "}"
+              << std::endl;
+}
+
+void benchAllocations(int num_rounds, int tasks_per_round) {
+    auto start = ns::system_clock::now();
+    std::atomic<int> num_run{0};
+    std::vector<int> ids(tasks_per_round);  // allocated before we count
+    uint64_t allocations = 0;
+    double seconds = 0;
+    {
+        TaskScheduler TS(start, {.max_duration = 10000ms, .verbose = false});
+        auto round = [&]() {
+            int target = num_run + tasks_per_round;
+            auto now = ns::system_clock::now();
+            for (int i = 0; i < tasks_per_round; ++i) {
+                // a capture this small is stored inside the std::function
+                TS.scheduleInClass(0, now, [&num_run]() { ++num_run; });
+                ids[i] = TS.scheduleTask(now + 3600s, 0ms);
+            }
+            for (int id : ids) {
+                TS.deleteScheduled(id);
+            }
+            while (num_run < target) {
+                std::this_thread::sleep_for(1ms);
+            }
+        };
+        for (int r = 0; r < 3; ++r) {
+            round();  // warm-up: the slab and the vectors grow to their peak
+        }
+        uint64_t before = num_allocations;
+        auto t0 = ns::steady_clock::now();
+        for (int r = 0; r < num_rounds; ++r) {
+            round();
+        }
+        seconds = ns::duration<double>(ns::steady_clock::now() - t0).count();
+        allocations = num_allocations - before;
+    }
+    double num_tasks = 2.0 * num_rounds * tasks_per_round;
+    std::cout << "{\"bench\":\"allocations\",\"tasks\":" << num_tasks
+              << ",\"allocations\":" << allocations
+              << ",\"allocations_per_task\":" << allocations / num_tasks
+              << ",\"ns_per_task\":" << seconds * 1e9 / num_tasks << "}"
+              << std::endl;
+}
+
+void benchScheduleCancel(size_t num_producers) {
+    constexpr int TOTAL_PAIRS = 256000;  // split over the producers
+    auto start = ns::system_clock::now();
+    auto later = start + 3600s;
+    double pairs_per_s = 0;
+    std::atomic<int> refused{0}, not_deleted{0};  // should both stay 0
+    {
+        TaskScheduler TS(start, {.max_duration = getRunDuration(TOTAL_PAIRS),
+                                 .verbose = false});
+        pairs_per_s = runProducers(
+            num_producers, TOTAL_PAIRS / num_producers, [&](int i) {
+                int id = TS.scheduleTask(later + ns::milliseconds{i}, 0ms);
+                if (id < 0) {
+                    ++refused;
+                } else if (!TS.deleteScheduled(id)) {
+                    ++not_deleted;
+                }
+            });
+    }
+    std::cout << "{\"bench\":\"schedule_cancel\",\"num_producers\":"
+              << num_producers << ",\"pairs_per_s\":" << pairs_per_s
+              << ",\"refused\":" << refused
+              << ",\"not_deleted\":" << not_deleted << "}" << std::endl;
+}
+
+void benchLatency(size_t num_load_threads) {
+    constexpr int NUM_TIMERS = 80;
+    constexpr auto SPACING = 25000us;
+    auto start = ns::system_clock::now();
+    std::vector<double> late_us(NUM_TIMERS);
+    {
+        TaskScheduler TS(start, {.max_duration = 2500ms, .verbose = false});
+        auto first = start + 100ms;
+        for (int i = 0; i < NUM_TIMERS; ++i) {
+            auto due = first + i * SPACING;
+            TS.scheduleInClass(0, due, [&late_us, i, due]() {
+                late_us[i] = ns::duration<double, std::micro>(
+                                 ns::system_clock::now() - due)
+                                 .count();
+            });
+        }
+        std::atomic<bool> done{false};
+        std::vector<std::thread> load;
+        for (size_t l = 0; l < num_load_threads; ++l) {
+            load.emplace_back([&]() {
+                for (int i = 0; !done; ++i) {
+                    TS.deleteScheduled(
+                        TS.scheduleTask(start + 3600s + ns::milliseconds{i},
+                                        0ms));
+                }
+            });
+        }
+        std::this_thread::sleep_until(first + NUM_TIMERS * SPACING + 50ms);
+        done = true;
+        for (auto& t : load) {
+            t.join();
+        }
+    }
+    double mean = 0, var = 0;
+    for (double x : late_us) {
+        mean += x / NUM_TIMERS;
+    }
+    for (double x : late_us) {
+        var += (x - mean) * (x - mean) / NUM_TIMERS;
+    }
+    std::sort(late_us.begin(), late_us.end());
+    auto pct = [&](double q) {
+        return late_us[static_cast<size_t>(q * (NUM_TIMERS - 1))];
+    };
+    std::cout << "{\"bench\":\"latency\",\"num_load_threads\":"
+              << num_load_threads << ",\"num_timers\":" << NUM_TIMERS
+              << ",\"spacing_us\":" << SPACING.count()
+              << ",\"min_us\":" << late_us.front()
+              << ",\"p50_us\":" << pct(0.5) << ",\"p99_us\":" << pct(0.99)
+              << ",\"max_us\":" << late_us.back()
+              << ",\"stddev_us\":" << std::sqrt(var) << "}" << std::endl;
+}
+
+void benchPendingTimers(int num_timers) {
+    auto start = ns::system_clock::now();
+    auto later = start + 3600s;
+    size_t bytes_before = mallinfo2().uordblks;
+    size_t bytes_after = 0;
+    MetricsSnapshot before, after;
+    {
+        TaskScheduler TS(start, {.max_duration = 2000ms, .verbose = false});
+        for (int i = 0; i < num_timers; ++i) {
+            TS.scheduleTask(later + ns::milliseconds{i}, 0ms);
+        }
+        // includes the scheduler itself, which is small next to the timers
+        bytes_after = mallinfo2().uordblks;
+        std::this_thread::sleep_for(100ms);
+        before = TS.getMetricsSnapshot();
+        std::this_thread::sleep_for(1000ms);
+        after = TS.getMetricsSnapshot();
+    }
+    std::cout << "{\"bench\":\"pending_timers\",\"num_timers\":"
+              << num_timers << ",\"bytes_per_timer\":"
+              << double(bytes_after - bytes_before) / num_timers
+              << ",\"idle_wakeups_per_s\":" << after.wakeups - before.wakeups
+              << "}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::set<std::string> only(argv + 1, argv + argc);
+    auto wanted = [&](const std::string& name) {
+        return only.empty() || only.contains(name);
+    };
+    size_t num_cores = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "{\"bench\":\"config\",\"num_cores\":" << num_cores
+              << ",\"compiler\":\"" << __VERSION__ << "\"}" << std::endl;
+    if (wanted("heartbeats")) {
+        for (auto slack : {0ms, 5ms, 20ms, 100ms}) {
+            benchHeartbeats(2000, 1000ms, slack, 3000ms);
+        }
+    }
+    if (wanted("parallel_for")) {
+        for (size_t grain : {size_t{1} << 22, size_t{1} << 14,
+                             size_t{1} << 10, size_t{1} << 6}) {
+            benchParallelFor(num_cores, grain);
+        }
+    }
+    if (wanted("sharded")) {
+        for (size_t p = 1; p <= num_cores; p *= 2) {
+            benchSharded(p);
+        }
+    }
+    if (wanted("recurrence")) {
+        benchRecurrence();
+    }
+    if (wanted("allocations")) {
+        benchAllocations(100, 1000);
+    }
+    if (wanted("schedule_cancel")) {
+        for (size_t p = 1; p <= 64; p *= 2) {
+            benchScheduleCancel(p);
+        }
+    }
+    if (wanted("latency")) {
+        for (size_t l : {0, 1, 4}) {
+            benchLatency(l);
+        }
+    }
+    if (wanted("pending_timers")) {
+        for (int n : {1000, 100000}) {
+            benchPendingTimers(n);
+        }
+    }
+}
@@ -0,0 +1,134 @@
+/*
+    A Chase-Lev work-stealing deque of pointers. The owner thread pushes and
+   pops at the bottom (LIFO, so it keeps working on the most recently spawned
+   and therefore cache-hot job) while any other thread can steal from the top
+   (FIFO, so thieves take the oldest and typically largest piece of work).
+
+   The owner's push and pop only synchronize with thieves when the deque is
+   almost empty; otherwise they are a few relaxed loads and stores. Thieves
+   race each other (and the owner, for the last element) with a CAS on top.
+   We follow the C11 memory orderings from Le, Pop, Cohen and Zappa Nardelli,
+   "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+
+   The ring buffer grows (only the owner grows it) but never shrinks. A thief
+   might still be reading the old buffer after the owner switched to a new
+   one, so old buffers are kept until the deque is destroyed. They total less
+   than the current buffer since each is half the size of the next.
+*/
+
+#ifndef CHASE_LEV_DEQUE_H_
+#define CHASE_LEV_DEQUE_H_
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+template <typename T>
+class ChaseLevDeque {
+   public:
+    explicit ChaseLevDeque(size_t log_capacity = 6)
+        : buffer(new Buffer(log_capacity)) {
+        buffers.emplace_back(buffer.load(std::memory_order_relaxed));
+    }
+    ChaseLevDeque(const ChaseLevDeque& other) = delete;
+    ChaseLevDeque& operator=(const ChaseLevDeque& other) = delete;
+
+    // Owner only
+    void push(T* item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer* buf = buffer.load(std::memory_order_relaxed);
+        if (b - t > buf->mask) {
+            buf = grow(buf, t, b);
+        }
+        buf->put(b, item);
+        // publishes the item (and what it points to) to thieves. The paper
+        // uses a release fence and a relaxed store, which is the same thing
+        // but invisible to ThreadSanitizer.
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only. Returns nullptr if empty.
+    T* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buf = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {  // was empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = buf->get(b);
+        if (t == b) {
+            // the last element: race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Returns nullptr if empty or if another thread won the race
+    // for the top element (the caller just looks elsewhere).
+    T* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        T* item = buffer.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    // Any thread, approximate unless called by the owner
+    bool getIsEmpty() const {
+        return bottom.load(std::memory_order_relaxed) <=
+               top.load(std::memory_order_relaxed);
+    }
+
+   private:
+    struct Buffer {
+        explicit Buffer(size_t log_capacity)
+            : mask((int64_t{1} << log_capacity) - 1),
+              slots(new std::atomic<T*>[mask + 1]) {}
+
+        T* get(int64_t i) const {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+        void put(int64_t i, T* item) {
+            slots[i & mask].store(item, std::memory_order_relaxed);
+        }
+
+        const int64_t mask;  // capacity - 1
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    Buffer* grow(Buffer* old, int64_t t, int64_t b) {
+        auto buf = new Buffer(std::bit_width(uint64_t(old->mask)) + 1);
+        for (int64_t i = t; i < b; ++i) {
+            buf->put(i, old->get(i));
+        }
+        buffers.emplace_back(buf);
+        buffer.store(buf, std::memory_order_release);
+        return buf;
+    }
+
+    // top and bottom on separate cache lines: thieves hammer top
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Buffer*> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;  // incl. old ones, owner only
+};
+
+#endif  // CHASE_LEV_DEQUE_H_
@@ -0,0 +1,162 @@
+/*
+    Lets the scheduler's event loop sleep in epoll_wait instead of on its
+   condition variable, so that the same thread can also react to file
+   descriptors (sockets, pipes, timerfds...) becoming ready. A gateway then
+   needs no separate network thread that forwards every message to the
+   scheduler with scheduleTask.
+
+   1) The timeout passed to epoll is derived from the next timer, so timers
+   work exactly as before. We use epoll_pwait2 (nanosecond timeout) where the
+   kernel has it (5.11+), otherwise epoll_wait with the timeout rounded up to
+   the next millisecond, so we never wake up before the deadline.
+   2) Other threads wake the loop up (a task was added or deleted) by writing
+   to an eventfd that is registered with the same epoll instance. This takes
+   the place of notify_one on the condition variable.
+   3) Ready fd callbacks are run on the loop thread as soon as epoll returns,
+   without q_mutex, so they can schedule tasks. They should be short: while
+   one runs, no timer can fire.
+
+   Watching and unwatching fds is safe from any thread, including from inside
+   a callback. Callbacks are kept behind a shared_ptr so an fd can be unwatched
+   while its callback is running.
+*/
+
+#ifndef EPOLL_REACTOR_H_
+#define EPOLL_REACTOR_H_
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+class EpollReactor {
+   public:
+    using Callback = std::function<void(uint32_t events)>;
+
+    EpollReactor()
+        : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+          wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        if (epoll_fd < 0 || wake_fd < 0 ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+            closeFds();
+            throw std::runtime_error("cannot set up epoll");
+        }
+    }
+    ~EpollReactor() { closeFds(); }
+    EpollReactor(const EpollReactor& other) = delete;
+    EpollReactor& operator=(const EpollReactor& other) = delete;
+
+    // Returns false if epoll refused the fd (e.g. already watched)
+    bool add(int fd, uint32_t events, Callback cb) {
+        std::scoped_lock lck(callbacks_mutex);
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return false;
+        }
+        callbacks[fd] = std::make_shared<Callback>(std::move(cb));
+        return true;
+    }
+
+    bool remove(int fd) {
+        std::scoped_lock lck(callbacks_mutex);
+        if (callbacks.erase(fd) == 0) {
+            return false;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);  // fd may be closed
+        return true;
+    }
+
+    // Any thread. Makes the current or next poll return.
+    void wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = write(wake_fd, &one, sizeof(one));
+    }
+
+    // Loop thread only. Waits until deadline, a wake or a ready fd, and runs
+    // the callbacks of ready fds. Returns the number of callbacks run.
+    int poll(std::chrono::system_clock::time_point deadline) {
+        auto timeout = std::chrono::ceil<std::chrono::nanoseconds>(
+            deadline - std::chrono::system_clock::now());
+        if (timeout.count() < 0) {
+            timeout = std::chrono::nanoseconds{0};
+        }
+        int n = waitFor(timeout);
+        int num_run = 0;
+        for (int i = 0; i < n; ++i) {
+            int fd = ready[i].data.fd;
+            if (fd == wake_fd) {
+                uint64_t count;
+                [[maybe_unused]] auto r = read(wake_fd, &count, sizeof(count));
+                continue;
+            }
+            std::shared_ptr<Callback> cb;
+            {
+                std::scoped_lock lck(callbacks_mutex);
+                auto it = callbacks.find(fd);
+                if (it == callbacks.end()) {
+                    continue;  // unwatched since epoll returned
+                }
+                cb = it->second;
+            }
+            (*cb)(ready[i].events);
+            ++num_run;
+        }
+        return num_run;
+    }
+
+   private:
+    static constexpr int MAX_EVENTS = 64;
+
+    int waitFor(std::chrono::nanoseconds timeout) {
+        if (has_pwait2) {
+            auto s = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            timespec ts{static_cast<time_t>(s.count()),
+                        static_cast<long>((timeout - s).count())};
+            int n = epoll_pwait2(epoll_fd, ready.data(), MAX_EVENTS, &ts,
+                                 nullptr);
+            if (n >= 0 || errno != ENOSYS) {
+                return std::max(n, 0);  // EINTR counts as a spurious wakeup
+            }
+            has_pwait2 = false;  // old kernel, fall back for good
+        }
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(timeout);
+        int n = epoll_wait(epoll_fd, ready.data(), MAX_EVENTS,
+                           static_cast<int>(std::min<int64_t>(
+                               ms.count(), std::numeric_limits<int>::max())));
+        return std::max(n, 0);
+    }
+
+    void closeFds() {
+        if (wake_fd >= 0) {
+            close(wake_fd);
+        }
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
+        }
+    }
+
+    int epoll_fd;
+    int wake_fd;
+    bool has_pwait2 = true;
+    std::array<epoll_event, MAX_EVENTS> ready;
+    std::mutex callbacks_mutex;
+    std::unordered_map<int, std::shared_ptr<Callback>> callbacks;
+};
+
+#endif  // EPOLL_REACTOR_H_
@@ -0,0 +1,86 @@
+/*
+    Fork-join parallelism for code that is already running on the worker pool,
+   e.g. an end-of-day task that recomputes something for every symbol:
+
+     TS.scheduleTask(eod, [&]() {
+         parallelFor(0, symbols.size(), [&](size_t i) { snapshot(i); });
+     });
+
+   A TaskGroup spawns children with spawn(fn) and waits for them with sync().
+   Children go on the current worker's deque (see worker_pool.h), and while
+   the parent waits it runs its own children or steals other work, so no
+   worker ever blocks on a sync. parallelFor splits its range in halves,
+   spawning one half and recursing into the other, so the pieces idle workers
+   steal are the biggest ones left, and each level of the recursion keeps its
+   job on the stack (no allocation).
+
+   Outside of a worker (no pool, or called from a client thread), spawn runs
+   the child right away and parallelFor is a plain loop, so the same task code
+   also works on a scheduler without workers.
+
+   Children must not throw: there is nobody to catch the exception on a thief.
+*/
+
+#ifndef FORK_JOIN_H_
+#define FORK_JOIN_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+
+#include "worker_pool.h"
+
+class TaskGroup {
+   public:
+    TaskGroup() : pool(WorkerPool::getCurrent()) {}
+    ~TaskGroup() { sync(); }  // children may reference the spawning frame
+    TaskGroup(const TaskGroup& other) = delete;
+    TaskGroup& operator=(const TaskGroup& other) = delete;
+
+    // fn may run on any worker, before, while or after the caller continues
+    void spawn(std::function<void()> fn) {
+        if (!pool) {
+            fn();
+            return;
+        }
+        // a std::deque never moves its elements, so the jobs stay put
+        auto& child = children.emplace_back(std::move(fn), StealableJob{});
+        child.second = StealableJob::make(child.first, &pending);
+        pending.fetch_add(1, std::memory_order_relaxed);
+        pool->spawn(&child.second);
+    }
+
+    // Returns once every child spawned so far has finished
+    void sync() {
+        if (pool) {
+            pool->helpUntilDone(pending);
+        }
+    }
+
+   private:
+    WorkerPool* pool;
+    std::atomic<int> pending{0};
+    std::deque<std::pair<std::function<void()>, StealableJob>> children;
+};
+
+// Calls fn(i) for every i in [begin, end), in parallel pieces of at most grain
+// indices each. Pick grain so that a piece takes at least a few microseconds.
+template <typename F>
+void parallelFor(size_t begin, size_t end, const F& fn, size_t grain = 1) {
+    WorkerPool* pool = WorkerPool::getCurrent();
+    if (!pool || end - begin <= grain) {
+        for (size_t i = begin; i < end; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    std::atomic<int> pending{1};
+    auto upper = [&]() { parallelFor(mid, end, fn, grain); };
+    auto job = StealableJob::make(upper, &pending);
+    pool->spawn(&job);
+    parallelFor(begin, mid, fn, grain);
+    pool->helpUntilDone(pending);
+}
+
+#endif  // FORK_JOIN_H_
@@ -0,0 +1,288 @@
+/*
+    Calendar-based recurrence, e.g. "every 5 minutes from 9:30 to 16:00 on
+   exchange days", for tasks that cannot be expressed with a fixed
+   repeat_interval. Without it, such a task has to wake up all the time and
+   check the clock; with it, the task sits in the queue until its next fire
+   time, so thousands of rules cost nothing outside their windows.
+
+   A rule is compiled once into two bitsets:
+   1) the minutes of the day at which it fires (1440 bits = 23 words), from
+   cron fields or from session windows plus a step,
+   2) the days on which it fires, over the horizon of its TradingCalendar (or
+   ten years from now), which folds in the calendar's holidays and weekends
+   and the cron day-of-month, month and day-of-week fields.
+   The next fire time is then "the next set minute today, else the first set
+   minute of the next set day", i.e. a count-trailing-zeros scan over a fixed
+   number of words, independent of how far away the next fire is. Rules only
+   use minute resolution.
+
+   Times are in a fixed UTC offset (a rule has no notion of daylight saving
+   time). Cron fields are "minute hour day-of-month month day-of-week", each
+   "*", "a", "a-b" or "a,b,...", optionally with "/step". Sunday is 0 or 7.
+   As in standard cron, if both day fields are restricted (neither starts
+   with "*"), a day matches if either of them does, e.g. "0 12 1 * 1" fires
+   on the 1st of the month and on every Monday.
+*/
+
+#ifndef RECURRENCE_RULE_H_
+#define RECURRENCE_RULE_H_
+
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ns = std::chrono;
+
+// Open days over a fixed horizon. Shared by every rule of an exchange.
+class TradingCalendar {
+   public:
+    TradingCalendar(ns::year_month_day first, ns::year_month_day last,
+                    const std::vector<ns::year_month_day>& holidays = {},
+                    bool weekdays_only = true)
+        : first_day(ns::sys_days(first)),
+          num_days((ns::sys_days(last) - first_day).count() + 1) {
+        open.assign((num_days + 63) / 64, 0);
+        for (int i = 0; i < num_days; ++i) {
+            ns::weekday wd(first_day + ns::days{i});
+            if (!weekdays_only || (wd != ns::Saturday && wd != ns::Sunday)) {
+                open[i / 64] |= uint64_t{1} << (i % 64);
+            }
+        }
+        for (auto h : holidays) {
+            int i = (ns::sys_days(h) - first_day).count();
+            if (i >= 0 && i < num_days) {
+                open[i / 64] &= ~(uint64_t{1} << (i % 64));
+            }
+        }
+    }
+
+    bool getIsOpen(ns::sys_days day) const {
+        int i = (day - first_day).count();
+        return i >= 0 && i < num_days && (open[i / 64] >> (i % 64) & 1);
+    }
+
+    ns::sys_days getFirstDay() const { return first_day; }
+    int getNumDays() const { return num_days; }
+
+   private:
+    ns::sys_days first_day;
+    int num_days;
+    std::vector<uint64_t> open;
+};
+
+class RecurrenceRule {
+   public:
+    struct Session {
+        ns::minutes open;   // since local midnight
+        ns::minutes close;  // exclusive
+    };
+
+    // Returns nullptr if spec is not a valid 5-field cron expression
+    static std::shared_ptr<RecurrenceRule> fromCron(
+        const std::string& spec,
+        std::shared_ptr<const TradingCalendar> calendar = nullptr,
+        ns::minutes utc_offset = ns::minutes{0}) {
+        std::istringstream in(spec);
+        std::array<std::string, 5> fields;
+        for (auto& f : fields) {
+            if (!(in >> f)) {
+                return nullptr;
+            }
+        }
+        std::string extra;
+        if (in >> extra) {
+            return nullptr;
+        }
+        // bounds of minute, hour, day of month, month, day of week
+        constexpr int LO[5] = {0, 0, 1, 1, 0};
+        constexpr int HI[5] = {59, 23, 31, 12, 7};
+        std::array<uint64_t, 5> masks{};
+        for (int i = 0; i < 5; ++i) {
+            if (!parseField(fields[i], LO[i], HI[i], masks[i])) {
+                return nullptr;
+            }
+        }
+        if (masks[4] >> 7 & 1) {
+            masks[4] |= 1;  // 7 is also Sunday
+        }
+        auto rule = std::make_shared<RecurrenceRule>(std::move(calendar),
+                                                     utc_offset);
+        for (int h = 0; h < 24; ++h) {
+            for (int m = 0; m < 60; ++m) {
+                if ((masks[1] >> h & 1) && (masks[0] >> m & 1)) {
+                    rule->setMinute(h * 60 + m);
+                }
+            }
+        }
+        bool either_day = fields[2][0] != '*' && fields[4][0] != '*';
+        rule->compileDays(masks[2], masks[3], masks[4], either_day);
+        return rule;
+    }
+
+    // Fires every step within each session, starting at its open
+    static std::shared_ptr<RecurrenceRule> everyDuringSessions(
+        ns::minutes step, const std::vector<Session>& sessions,
+        std::shared_ptr<const TradingCalendar> calendar = nullptr,
+        ns::minutes utc_offset = ns::minutes{0}) {
+        if (step <= ns::minutes{0}) {
+            return nullptr;
+        }
+        auto rule = std::make_shared<RecurrenceRule>(std::move(calendar),
+                                                     utc_offset);
+        for (const auto& s : sessions) {
+            for (auto m = s.open; m < s.close && m < ns::days{1}; m += step) {
+                rule->setMinute(m.count());
+            }
+        }
+        rule->compileDays(~uint64_t{0}, ~uint64_t{0}, ~uint64_t{0});
+        return rule;
+    }
+
+    RecurrenceRule(std::shared_ptr<const TradingCalendar> cal,
+                   ns::minutes offset)
+        : calendar(std::move(cal)), utc_offset(offset) {}
+
+    // The first fire time strictly after t, or time_point::max() if there is
+    // none within the horizon
+    ns::system_clock::time_point getNextFire(
+        ns::system_clock::time_point t) const {
+        auto local = ns::floor<ns::minutes>(t) + utc_offset;
+        auto day = ns::floor<ns::days>(local);
+        int di = (day - first_day).count();
+        int minute = (local - day).count() + 1;
+        if (di >= 0 && di < num_days && getIsSet(days, di)) {
+            int m = findNext(minutes, minute, MINUTES_PER_DAY);
+            if (m >= 0) {
+                return toTime(di, m);
+            }
+        }
+        di = findNext(days, std::max(di + 1, 0), num_days);
+        int m = findNext(minutes, 0, MINUTES_PER_DAY);
+        if (di < 0 || m < 0) {
+            return ns::system_clock::time_point::max();
+        }
+        return toTime(di, m);
+    }
+
+   private:
+    static constexpr int MINUTES_PER_DAY = 24 * 60;
+    static constexpr int DEFAULT_HORIZON_DAYS = 3653;
+
+    // "*", "a", "a-b", "a,b", each optionally "/step". Every list item must
+    // be one of these in full, so "5x" or "1,,2" is an error.
+    static bool parseField(std::string_view field, int lo, int hi,
+                           uint64_t& mask) {
+        while (true) {
+            auto comma = field.find(',');
+            std::string_view part = field.substr(0, comma);
+            int first = lo, last = hi, step = 1;
+            auto slash = part.find('/');
+            std::string_view range = part.substr(0, slash);
+            if (slash != std::string_view::npos &&
+                !parseInt(part.substr(slash + 1), step)) {
+                return false;
+            }
+            if (range != "*") {
+                auto dash = range.find('-');
+                if (!parseInt(range.substr(0, dash), first)) {
+                    return false;
+                }
+                if (dash != std::string_view::npos) {
+                    if (!parseInt(range.substr(dash + 1), last)) {
+                        return false;
+                    }
+                } else {
+                    last = slash == std::string_view::npos ? first : hi;
+                }
+            }
+            if (step <= 0 || first < lo || last > hi || first > last) {
+                return false;
+            }
+            for (int v = first; v <= last; v += step) {
+                mask |= uint64_t{1} << v;
+            }
+            if (comma == std::string_view::npos) {
+                return true;
+            }
+            field.remove_prefix(comma + 1);
+        }
+    }
+
+    // true iff all of s is a decimal number
+    static bool parseInt(std::string_view s, int& value) {
+        const char* end = s.data() + s.size();
+        auto [ptr, ec] = std::from_chars(s.data(), end, value);
+        return ec == std::errc{} && ptr == end;
+    }
+
+    void setMinute(int m) { minutes[m / 64] |= uint64_t{1} << (m % 64); }
+
+    // either_day: the day of month or the day of week must match, not both
+    void compileDays(uint64_t dom_mask, uint64_t month_mask,
+                     uint64_t dow_mask, bool either_day = false) {
+        if (calendar) {
+            first_day = calendar->getFirstDay();
+            num_days = calendar->getNumDays();
+        } else {
+            first_day = ns::floor<ns::days>(ns::system_clock::now()) -
+                        ns::days{1};
+            num_days = DEFAULT_HORIZON_DAYS;
+        }
+        days.assign((num_days + 63) / 64, 0);
+        for (int i = 0; i < num_days; ++i) {
+            auto d = first_day + ns::days{i};
+            ns::year_month_day ymd(d);
+            bool dom = dom_mask >> unsigned(ymd.day()) & 1;
+            bool dow = dow_mask >> ns::weekday(d).c_encoding() & 1;
+            if ((!calendar || calendar->getIsOpen(d)) &&
+                (month_mask >> unsigned(ymd.month()) & 1) &&
+                (either_day ? dom || dow : dom && dow)) {
+                days[i / 64] |= uint64_t{1} << (i % 64);
+            }
+        }
+    }
+
+    static bool getIsSet(const std::vector<uint64_t>& bits, int i) {
+        return bits[i / 64] >> (i % 64) & 1;
+    }
+
+    // First set bit at index >= from (and < size), or -1
+    template <typename Bits>
+    static int findNext(const Bits& bits, int from, int size) {
+        if (from >= size) {
+            return -1;
+        }
+        size_t w = from / 64;
+        uint64_t word = bits[w] & (~uint64_t{0} << (from % 64));
+        while (word == 0) {
+            if (++w == std::size(bits)) {
+                return -1;
+            }
+            word = bits[w];
+        }
+        int i = static_cast<int>(w * 64) + std::countr_zero(word);
+        return i < size ? i : -1;
+    }
+
+    ns::system_clock::time_point toTime(int di, int minute) const {
+        auto local = first_day + ns::days{di} + ns::minutes{minute};
+        return ns::system_clock::time_point(local - utc_offset);
+    }
+
+    std::shared_ptr<const TradingCalendar> calendar;
+    ns::minutes utc_offset;
+    std::array<uint64_t, (MINUTES_PER_DAY + 63) / 64> minutes{};
+    ns::sys_days first_day;
+    int num_days{0};
+    std::vector<uint64_t> days;
+};
+
+#endif  // RECURRENCE_RULE_H_
@@ -0,0 +1,263 @@
+/*
+    A persistent schedule, so that a restarted scheduler does not have to be
+   re-populated by its clients. It consists of two files:
+   1) <path>.log: an append-only log with one small binary record per schedule,
+   cancel or done (single task has been run) operation,
+   2) <path>.snap: a snapshot of every live registration at some point in time.
+
+   The log keeps an in-memory copy of the live registrations (updated with
+   every append, and whenever a repeated task moves on to its next iteration)
+   so taking a snapshot never requires replaying anything. Once enough records
+   have been appended since the last snapshot, a new snapshot is taken:
+   1) under q_mutex, <path>.log is renamed to <path>.log.old, a fresh log is
+   started and the live registrations are copied (all cheap),
+   2) without q_mutex, the copy is written to <path>.snap.tmp which is then
+   renamed over <path>.snap, and <path>.log.old is removed.
+   On recovery we compact everything into a new snapshot straight away.
+   A crash anywhere in between is harmless, because recovery replays snapshot,
+   old log and current log in that order, and replaying an old log on top of
+   a newer snapshot changes nothing (every record is an idempotent insert or
+   erase, and for an existing registration we keep the later start time).
+
+   Records are written with fwrite and flushed to the OS after every append:
+   a crash of the process loses nothing, a crash of the machine might. A torn
+   record at the end of a log is ignored.
+
+   The log is not thread-safe: the scheduler only calls it under q_mutex
+   (except for writeSnapshot, which only touches the snapshot files and reads
+   max_task_id, which is atomic for that reason).
+*/
+
+#ifndef SCHEDULE_LOG_H_
+#define SCHEDULE_LOG_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What to do with iterations that should have run while we were down
+enum class MissedRunPolicy {
+    SKIP,      // drop them; repeated tasks resume at their next iteration
+    RUN_ONCE,  // run once as soon as possible, then resume
+    RUN_ALL,   // run every missed iteration back-to-back
+};
+
+// All times in milliseconds since the system_clock epoch
+struct ScheduleRecord {
+    int32_t task_id;
+    int32_t handler;  // -1 = simulated task with running_ms
+    int64_t start_ms;
+    int64_t interval_ms;  // 0 = single task
+    int64_t running_ms;
+    int64_t slack_ms;
+};
+
+class ScheduleLog {
+   public:
+    ScheduleLog(std::string p, size_t snapshot_every)
+        : path(std::move(p)), SNAPSHOT_EVERY(snapshot_every) {}
+    ~ScheduleLog() {
+        if (log_file) {
+            std::fclose(log_file);
+        }
+    }
+    ScheduleLog(const ScheduleLog& other) = delete;
+    ScheduleLog& operator=(const ScheduleLog& other) = delete;
+
+    // Rebuilds the live registrations from disk, compacts them into a fresh
+    // snapshot (which also gets rid of a torn record at the end of the log)
+    // and starts an empty log. Must be called once, before anything else.
+    std::vector<ScheduleRecord> recover() {
+        readSnapshot(path + ".snap");
+        replayLog(path + ".log.old");
+        replayLog(path + ".log");
+        auto records = getLiveRecords();
+        if (!writeSnapshot(records)) {
+            throw std::runtime_error("cannot write schedule snapshot " + path);
+        }
+        std::remove((path + ".log").c_str());
+        log_file = std::fopen((path + ".log").c_str(), "ab");
+        if (!log_file) {
+            throw std::runtime_error("cannot open schedule log " + path);
+        }
+        return records;
+    }
+
+    void appendSchedule(const ScheduleRecord& r) {
+        live.insert_or_assign(r.task_id, r);
+        raiseMaxTaskId(r.task_id);
+        append(OP_SCHEDULE, r);
+    }
+
+    // Cancelled and done are the same to us: the registration is gone. Both
+    // are no-ops for tasks that were never persisted.
+    void appendRemove(int task_id) {
+        if (live.erase(task_id) > 0) {
+            append(OP_REMOVE, ScheduleRecord{task_id, -1, 0, 0, 0, 0});
+        }
+    }
+
+    // Not logged: a repeated task's next iteration only reaches the disk with
+    // the next snapshot (at worst, a few iterations are run again on recovery)
+    void advance(int task_id, int64_t start_ms) {
+        auto it = live.find(task_id);
+        if (it != live.end()) {
+            it->second.start_ms = start_ms;
+        }
+    }
+
+    bool getIsSnapshotDue() const {
+        return num_appended >= SNAPSHOT_EVERY && log_file != nullptr;
+    }
+
+    // Step 1 (under q_mutex): rotate the log, return what to snapshot. If the
+    // last snapshot failed, rotating again would overwrite the old log that it
+    // was supposed to replace, so we keep appending to the current log (whose
+    // records are then partly redundant with the snapshot, which is harmless).
+    std::vector<ScheduleRecord> beginSnapshot() {
+        if (!old_log_pending) {
+            std::fclose(log_file);
+            std::rename((path + ".log").c_str(), (path + ".log.old").c_str());
+            log_file = std::fopen((path + ".log").c_str(), "ab");
+            if (!log_file) {
+                throw std::runtime_error("cannot open schedule log " + path);
+            }
+            old_log_pending = true;
+        }
+        num_appended = 0;
+        return getLiveRecords();
+    }
+
+    // Step 2 (without q_mutex). Returns false if the snapshot could not be
+    // written, in which case the old log is kept around.
+    bool writeSnapshot(const std::vector<ScheduleRecord>& records) {
+        auto tmp_path = path + ".snap.tmp";
+        std::FILE* f = std::fopen(tmp_path.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        uint64_t n = records.size();
+        int64_t max_id = max_task_id.load(std::memory_order_relaxed);
+        std::fwrite(&SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), 1, f);
+        std::fwrite(&n, sizeof(n), 1, f);
+        std::fwrite(&max_id, sizeof(max_id), 1, f);
+        std::fwrite(records.data(), sizeof(ScheduleRecord), n, f);
+        bool ok = std::fflush(f) == 0;
+        std::fclose(f);
+        if (!ok || std::rename(tmp_path.c_str(), (path + ".snap").c_str())) {
+            return false;
+        }
+        std::remove((path + ".log.old").c_str());
+        old_log_pending = false;
+        return true;
+    }
+
+    size_t size() const { return live.size(); }
+
+    // Including tasks that are gone, so that task_ids are never reused
+    int getMaxTaskId() const {
+        return max_task_id.load(std::memory_order_relaxed);
+    }
+
+   private:
+    static constexpr uint8_t OP_SCHEDULE = 1;
+    static constexpr uint8_t OP_REMOVE = 2;
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x31504e5348435354;  // TSCHSNP1
+
+    // Only called under q_mutex (or before the loop starts), so there is a
+    // single writer and no need for a compare-exchange
+    void raiseMaxTaskId(int task_id) {
+        if (task_id > max_task_id.load(std::memory_order_relaxed)) {
+            max_task_id.store(task_id, std::memory_order_relaxed);
+        }
+    }
+
+    std::vector<ScheduleRecord> getLiveRecords() const {
+        std::vector<ScheduleRecord> records;
+        records.reserve(live.size());
+        for (const auto& [id, r] : live) {
+            records.push_back(r);
+        }
+        return records;
+    }
+
+    void append(uint8_t op, const ScheduleRecord& r) {
+        if (!log_file) {
+            return;
+        }
+        std::fwrite(&op, sizeof(op), 1, log_file);
+        if (op == OP_SCHEDULE) {
+            std::fwrite(&r, sizeof(r), 1, log_file);
+        } else {
+            std::fwrite(&r.task_id, sizeof(r.task_id), 1, log_file);
+        }
+        std::fflush(log_file);
+        ++num_appended;
+    }
+
+    void readSnapshot(const std::string& snap_path) {
+        std::FILE* f = std::fopen(snap_path.c_str(), "rb");
+        if (!f) {
+            return;  // no snapshot yet
+        }
+        uint64_t magic = 0, n = 0;
+        int64_t max_id = 0;
+        if (std::fread(&magic, sizeof(magic), 1, f) == 1 &&
+            magic == SNAPSHOT_MAGIC && std::fread(&n, sizeof(n), 1, f) == 1 &&
+            std::fread(&max_id, sizeof(max_id), 1, f) == 1) {
+            raiseMaxTaskId(static_cast<int>(max_id));
+            ScheduleRecord r;
+            for (uint64_t i = 0; i < n && std::fread(&r, sizeof(r), 1, f) == 1;
+                 ++i) {
+                live.insert_or_assign(r.task_id, r);
+            }
+        }
+        std::fclose(f);
+    }
+
+    void replayLog(const std::string& log_path) {
+        std::FILE* f = std::fopen(log_path.c_str(), "rb");
+        if (!f) {
+            return;
+        }
+        uint8_t op;
+        while (std::fread(&op, sizeof(op), 1, f) == 1) {
+            if (op == OP_SCHEDULE) {
+                ScheduleRecord r;
+                if (std::fread(&r, sizeof(r), 1, f) != 1) {
+                    break;  // torn record
+                }
+                raiseMaxTaskId(r.task_id);
+                auto [it, inserted] = live.try_emplace(r.task_id, r);
+                if (!inserted && it->second.start_ms < r.start_ms) {
+                    it->second = r;
+                }
+            } else if (op == OP_REMOVE) {
+                int32_t task_id;
+                if (std::fread(&task_id, sizeof(task_id), 1, f) != 1) {
+                    break;
+                }
+                raiseMaxTaskId(task_id);
+                live.erase(task_id);
+            } else {
+                break;  // garbage, stop here
+            }
+        }
+        std::fclose(f);
+    }
+
+    std::string path;
+    const size_t SNAPSHOT_EVERY;
+    size_t num_appended{0};
+    bool old_log_pending{false};
+    std::atomic<int> max_task_id{0};  // read by writeSnapshot without q_mutex
+    std::FILE* log_file{nullptr};
+    std::unordered_map<int, ScheduleRecord> live;
+};
+
+#endif  // SCHEDULE_LOG_H_
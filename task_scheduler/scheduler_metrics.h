@@ -0,0 +1,237 @@
+/*
+    Built-in instrumentation for the task scheduler. We want to know:
+   1) how late tasks start relative to their start_time,
+   2) how long tasks run for,
+   3) how deep the queue gets,
+   4) how often the event loop wakes up, and whether the wakeup was useful
+   (something was run) or spurious (a new task or a deletion that did not
+   require running anything, or an early wakeup from the OS),
+   5) how long the event loop holds q_mutex at a time, since that is the time
+   producers are blocked,
+   6) how many new tasks were shed because the queue was full (rejected, or
+   dropped to make room for a newer one), and how many producers had to wait,
+   7) how long running tasks take to return once a stop was requested,
+   8) how often a due task had to be deferred by its class's rate limit.
+
+   The event loop is the only writer of most counters, but a monitoring thread
+   must be able to read them at any time without taking q_mutex (that would
+   perturb the very thing we are measuring). So every counter is a relaxed
+   std::atomic and a snapshot is just a series of loads. A snapshot is not a
+   consistent cut across counters, which is fine for monitoring.
+
+   Durations go into histograms with power-of-two buckets: bucket i holds
+   values in [2^(i-1), 2^i) ns, and bucket 0 holds zeros. Recording is a
+   bit_width plus one fetch_add, and percentiles are reported as the upper
+   bound of the bucket they fall in (i.e. within a factor of 2).
+*/
+
+#ifndef SCHEDULER_METRICS_H_
+#define SCHEDULER_METRICS_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+class LatencyHistogram {
+   public:
+    static constexpr size_t NUM_BUCKETS = 48;  // the last one is up to ~39h
+
+    struct Snapshot {
+        std::array<uint64_t, NUM_BUCKETS> counts{};
+        uint64_t count{0};
+        uint64_t sum_ns{0};
+        uint64_t max_ns{0};
+
+        double getMeanNs() const {
+            return count == 0 ? 0.0 : static_cast<double>(sum_ns) / count;
+        }
+
+        // Upper bound of the bucket containing the q-th quantile (0 <= q <= 1)
+        uint64_t getPercentileNs(double q) const {
+            if (count == 0) {
+                return 0;
+            }
+            auto rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return std::min(getBucketUpperNs(i), max_ns);
+                }
+            }
+            return max_ns;
+        }
+    };
+
+    void record(std::chrono::nanoseconds d) {
+        auto ns = static_cast<uint64_t>(std::max<int64_t>(d.count(), 0));
+        size_t idx = std::min<size_t>(std::bit_width(ns), NUM_BUCKETS - 1);
+        counts[idx].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        // only a max, so a plain compare-exchange loop is enough
+        uint64_t prev = max_ns.load(std::memory_order_relaxed);
+        while (prev < ns && !max_ns.compare_exchange_weak(
+                                prev, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    Snapshot snapshot() const {
+        Snapshot s;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            s.counts[i] = counts[i].load(std::memory_order_relaxed);
+        }
+        s.count = count.load(std::memory_order_relaxed);
+        s.sum_ns = sum_ns.load(std::memory_order_relaxed);
+        s.max_ns = max_ns.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    static uint64_t getBucketUpperNs(size_t idx) {
+        return idx == 0 ? 0 : (uint64_t{1} << idx) - 1;
+    }
+
+   private:
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> counts{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+struct MetricsSnapshot {
+    std::chrono::system_clock::time_point taken_at;
+    LatencyHistogram::Snapshot lateness;
+    LatencyHistogram::Snapshot run_time;
+    LatencyHistogram::Snapshot lock_hold;
+    LatencyHistogram::Snapshot cancel_latency;
+    uint64_t queue_depth{0};
+    uint64_t max_queue_depth{0};
+    uint64_t wakeups{0};
+    uint64_t useful_wakeups{0};
+    uint64_t spurious_wakeups{0};
+    uint64_t tasks_run{0};
+    uint64_t tasks_rejected{0};
+    uint64_t tasks_dropped{0};
+    uint64_t producers_blocked{0};
+    uint64_t tasks_cancelled{0};  // while running
+    uint64_t tasks_deferred{0};   // by a rate limit
+};
+
+class SchedulerMetrics {
+   public:
+    LatencyHistogram lateness;
+    LatencyHistogram run_time;
+    LatencyHistogram lock_hold;
+    LatencyHistogram cancel_latency;
+
+    // Callers (the loop, clients and workers) hold the scheduler's q_mutex,
+    // so the check and the store below cannot interleave
+    void setQueueDepth(size_t depth) {
+        queue_depth.store(depth, std::memory_order_relaxed);
+        if (depth > max_queue_depth.load(std::memory_order_relaxed)) {
+            max_queue_depth.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    // A wakeup is useful iff the loop ran or dispatched at least one task
+    void recordWakeup(bool useful) {
+        wakeups.fetch_add(1, std::memory_order_relaxed);
+        (useful ? useful_wakeups : spurious_wakeups)
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordSpuriousWakeups(uint64_t n) {
+        if (n > 0) {
+            wakeups.fetch_add(n, std::memory_order_relaxed);
+            spurious_wakeups.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void recordTaskRun() { tasks_run.fetch_add(1, std::memory_order_relaxed); }
+
+    void recordRejected() {
+        tasks_rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+    void recordDropped() {
+        tasks_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    void recordBlocked() {
+        producers_blocked.fetch_add(1, std::memory_order_relaxed);
+    }
+    void recordCancelled() {
+        tasks_cancelled.fetch_add(1, std::memory_order_relaxed);
+    }
+    void recordDeferred() {
+        tasks_deferred.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    MetricsSnapshot snapshot() const {
+        MetricsSnapshot s;
+        s.taken_at = std::chrono::system_clock::now();
+        s.lateness = lateness.snapshot();
+        s.run_time = run_time.snapshot();
+        s.lock_hold = lock_hold.snapshot();
+        s.cancel_latency = cancel_latency.snapshot();
+        s.queue_depth = queue_depth.load(std::memory_order_relaxed);
+        s.max_queue_depth = max_queue_depth.load(std::memory_order_relaxed);
+        s.wakeups = wakeups.load(std::memory_order_relaxed);
+        s.useful_wakeups = useful_wakeups.load(std::memory_order_relaxed);
+        s.spurious_wakeups = spurious_wakeups.load(std::memory_order_relaxed);
+        s.tasks_run = tasks_run.load(std::memory_order_relaxed);
+        s.tasks_rejected = tasks_rejected.load(std::memory_order_relaxed);
+        s.tasks_dropped = tasks_dropped.load(std::memory_order_relaxed);
+        s.producers_blocked = producers_blocked.load(std::memory_order_relaxed);
+        s.tasks_cancelled = tasks_cancelled.load(std::memory_order_relaxed);
+        s.tasks_deferred = tasks_deferred.load(std::memory_order_relaxed);
+        return s;
+    }
+
+   private:
+    std::atomic<uint64_t> queue_depth{0};
+    std::atomic<uint64_t> max_queue_depth{0};  // see setQueueDepth
+    std::atomic<uint64_t> wakeups{0};
+    std::atomic<uint64_t> useful_wakeups{0};
+    std::atomic<uint64_t> spurious_wakeups{0};
+    std::atomic<uint64_t> tasks_run{0};
+    std::atomic<uint64_t> tasks_rejected{0};
+    std::atomic<uint64_t> tasks_dropped{0};
+    std::atomic<uint64_t> producers_blocked{0};
+    std::atomic<uint64_t> tasks_cancelled{0};
+    std::atomic<uint64_t> tasks_deferred{0};
+};
+
+// One JSON object per snapshot, e.g. for a log line or a metrics scraper
+inline std::ostream& operator<<(std::ostream& os,
+                                const LatencyHistogram::Snapshot& h) {
+    return os << "{\"count\":" << h.count << ",\"mean_ns\":" << h.getMeanNs()
+              << ",\"p50_ns\":" << h.getPercentileNs(0.5)
+              << ",\"p99_ns\":" << h.getPercentileNs(0.99)
+              << ",\"max_ns\":" << h.max_ns << "}";
+}
+
+inline std::ostream& operator<<(std::ostream& os, const MetricsSnapshot& m) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        m.taken_at.time_since_epoch());
+    return os << "{\"taken_at_ms\":" << ms.count()
+              << ",\"lateness\":" << m.lateness
+              << ",\"run_time\":" << m.run_time
+              << ",\"lock_hold\":" << m.lock_hold
+              << ",\"cancel_latency\":" << m.cancel_latency
+              << ",\"queue_depth\":" << m.queue_depth
+              << ",\"max_queue_depth\":" << m.max_queue_depth
+              << ",\"wakeups\":" << m.wakeups
+              << ",\"useful_wakeups\":" << m.useful_wakeups
+              << ",\"spurious_wakeups\":" << m.spurious_wakeups
+              << ",\"tasks_run\":" << m.tasks_run
+              << ",\"tasks_rejected\":" << m.tasks_rejected
+              << ",\"tasks_dropped\":" << m.tasks_dropped
+              << ",\"producers_blocked\":" << m.producers_blocked
+              << ",\"tasks_cancelled\":" << m.tasks_cancelled
+              << ",\"tasks_deferred\":" << m.tasks_deferred << "}";
+}
+
+#endif  // SCHEDULER_METRICS_H_
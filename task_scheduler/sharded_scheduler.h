@@ -0,0 +1,181 @@
+/*
+    One TaskScheduler has one event loop and one q_mutex, which every producer
+   contends on. When all cores schedule timers, that lock (and the cache line
+   it lives on) becomes the bottleneck. The sharded scheduler is a facade over
+   one independent TaskScheduler per core, each with its event loop pinned to
+   its core, so that producers on different cores never touch the same queue.
+
+   The cores are the CPUs the process may run on (sched_getaffinity), which
+   under a cpuset or a container need not be 0 .. n-1. Shard i is pinned to
+   the i-th of them, and a table maps each of them back to its shard.
+
+   A task goes to one of two shards:
+   1) by default, the shard of the CPU the caller is running on (sched_getcpu,
+   which is a vDSO call and does not enter the kernel). A thread that stays on
+   its core thus schedules into a local queue whose loop runs on the same core.
+   2) with a key, the shard picked by the key's hash, so that every task for
+   e.g. the same symbol ends up on the same loop (and runs in order there).
+
+   Task ids are only unique within a shard, so the facade hands out handles
+   that also encode the shard: handle = task_id << SHARD_BITS | shard. That
+   way deleteScheduled goes straight to the right shard.
+
+   Every shard gets a copy of the options. If logging is on, each shard logs
+   to its own files (log_path + ".shard<i>").
+*/
+
+#ifndef SHARDED_SCHEDULER_H_
+#define SHARDED_SCHEDULER_H_
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "task_scheduler.h"
+
+class ShardedScheduler {
+   public:
+    using Handle = int64_t;  // -1 = refused
+    static constexpr int SHARD_BITS = 8;
+    static constexpr size_t MAX_SHARDS = size_t{1} << SHARD_BITS;
+
+    // 0 shards = one per allowed core. Shard i is pinned to the i-th allowed
+    // CPU (round robin if there are more shards) if pin is set.
+    ShardedScheduler(ns::system_clock::time_point s, size_t num_shards = 0,
+                     SchedulerOptions opts = {}, bool pin = true) {
+        std::vector<int> cpus = getAllowedCpus();
+        if (num_shards == 0) {
+            num_shards = std::max<size_t>(cpus.size(), 1);
+        }
+        num_shards = std::min(num_shards, MAX_SHARDS);
+        // CPUs beyond the shards share them round robin too
+        for (size_t j = 0; j < cpus.size(); ++j) {
+            if (cpu_to_shard.size() <= static_cast<size_t>(cpus[j])) {
+                cpu_to_shard.resize(cpus[j] + 1, 0);
+            }
+            cpu_to_shard[cpus[j]] = j % num_shards;
+        }
+        shards.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            shard_cpus.push_back(cpus.empty() ? -1 : cpus[i % cpus.size()]);
+            SchedulerOptions shard_opts = opts;
+            shard_opts.cpu = pin ? shard_cpus.back() : -1;
+            if (!opts.log_path.empty()) {
+                shard_opts.log_path += ".shard" + std::to_string(i);
+            }
+            shards.push_back(
+                std::make_unique<TaskScheduler>(s, std::move(shard_opts)));
+        }
+    }
+
+    size_t size() const { return shards.size(); }
+    TaskScheduler& getShard(size_t idx) { return *shards[idx]; }
+    // The CPU that shard idx is (or, without pinning, would be) pinned to,
+    // -1 if the allowed CPUs are unknown
+    int getShardCpu(size_t idx) const { return shard_cpus[idx]; }
+
+    // The shard of the CPU the caller is running on (0 for a CPU outside
+    // the process's affinity mask, e.g. after it was changed)
+    size_t getLocalShard() const {
+        int cpu = sched_getcpu();
+        return cpu >= 0 && static_cast<size_t>(cpu) < cpu_to_shard.size()
+                   ? cpu_to_shard[cpu]
+                   : 0;
+    }
+
+    template <typename Key>
+    size_t getShardForKey(const Key& key) const {
+        return std::hash<Key>{}(key) % shards.size();
+    }
+
+    Handle scheduleTask(ns::system_clock::time_point start_time,
+                        ns::milliseconds running_time,
+                        ns::milliseconds slack = ns::milliseconds{0}) {
+        size_t idx = getLocalShard();
+        return makeHandle(
+            shards[idx]->scheduleTask(start_time, running_time, slack), idx);
+    }
+
+    Handle scheduleTask(ns::system_clock::time_point start_time,
+                        std::function<void()> fn) {
+        size_t idx = getLocalShard();
+        return makeHandle(
+            shards[idx]->scheduleTask(start_time, std::move(fn), []() {}),
+            idx);
+    }
+
+    // Every task with the same key runs on the same shard's loop
+    template <typename Key>
+    Handle scheduleOnKey(const Key& key,
+                         ns::system_clock::time_point start_time,
+                         std::function<void()> fn) {
+        size_t idx = getShardForKey(key);
+        return makeHandle(
+            shards[idx]->scheduleTask(start_time, std::move(fn), []() {}),
+            idx);
+    }
+
+    Handle scheduleRepeated(ns::system_clock::time_point start_time,
+                            ns::milliseconds repeat_interval,
+                            ns::milliseconds running_time,
+                            ns::milliseconds slack = ns::milliseconds{0}) {
+        size_t idx = getLocalShard();
+        return makeHandle(shards[idx]->scheduleRepeated(
+                              start_time, repeat_interval, running_time, slack),
+                          idx);
+    }
+
+    bool deleteScheduled(Handle handle) {
+        if (handle < 0) {
+            return false;
+        }
+        size_t idx = handle & (MAX_SHARDS - 1);
+        return idx < shards.size() &&
+               shards[idx]->deleteScheduled(
+                   static_cast<int>(handle >> SHARD_BITS));
+    }
+
+    static size_t getShardOf(Handle handle) {
+        return handle & (MAX_SHARDS - 1);
+    }
+
+    // Sum over all shards of the counters (histograms are per shard)
+    uint64_t getTasksRun() const {
+        uint64_t n = 0;
+        for (const auto& shard : shards) {
+            n += shard->getMetricsSnapshot().tasks_run;
+        }
+        return n;
+    }
+
+   private:
+    static Handle makeHandle(int task_id, size_t idx) {
+        return task_id < 0 ? -1 : (Handle{task_id} << SHARD_BITS) | idx;
+    }
+
+    // In increasing order, empty if the mask cannot be read
+    static std::vector<int> getAllowedCpus() {
+        cpu_set_t allowed;
+        std::vector<int> cpus;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return cpus;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    std::vector<std::unique_ptr<TaskScheduler>> shards;
+    std::vector<int> shard_cpus;      // by shard
+    std::vector<size_t> cpu_to_shard;  // by CPU number
+};
+
+#endif  // SHARDED_SCHEDULER_H_
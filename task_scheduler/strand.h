@@ -0,0 +1,139 @@
+/*
+    A strand is a serial executor on top of the worker pool: jobs posted to the
+   same strand run one at a time and in the order they were posted, while jobs
+   on different strands run in parallel. This replaces a mutex per key (e.g.
+   one symbol's book) and no thread is dedicated to any strand.
+
+   Each strand is an intrusive multi-producer single-consumer queue (Dmitry
+   Vyukov's design, see
+   https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue)
+   plus an atomic count of pending jobs:
+   1) post pushes its node with one atomic exchange, then increments the count.
+   The poster that moves the count from 0 to 1 submits a drain job to the pool.
+   2) The drain job is then the only consumer. It pops and runs jobs and
+   decrements the count after each, and stops when the count reaches 0. Any
+   post that happens after that sees 0 again and submits a new drain job.
+   So neither producers nor the consumer ever take a lock, and at most one
+   drain job per strand exists at any time, which is what serializes the jobs.
+
+   To be fair to other strands, a drain job runs at most MAX_JOBS_PER_TURN jobs
+   before re-submitting itself to the back of the pool's queue. Without a pool,
+   jobs run on the posting thread (which then drains the whole strand).
+*/
+
+#ifndef STRAND_H_
+#define STRAND_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "worker_pool.h"
+
+class Strand {
+   public:
+    explicit Strand(WorkerPool* p) : pool(p) {}
+    ~Strand() {
+        // only the dummy node is left once every job has run
+        if (tail != &stub) {
+            delete tail;
+        }
+    }
+    Strand(const Strand& other) = delete;
+    Strand& operator=(const Strand& other) = delete;
+
+    void post(std::function<void()> job) {
+        auto node = new Node{{nullptr}, std::move(job)};
+        // the exchange orders concurrent posts: this is the submission order
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+        if (pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+            schedule();
+        }
+    }
+
+   private:
+    static constexpr int MAX_JOBS_PER_TURN = 64;
+
+    struct Node {
+        std::atomic<Node*> next;
+        std::function<void()> job;
+    };
+
+    void schedule() {
+        if (pool) {
+            pool->submit([this]() { drain(); });
+        } else {
+            drain();
+        }
+    }
+
+    void drain() {
+        for (int i = 0; !pool || i < MAX_JOBS_PER_TURN; ++i) {
+            auto job = pop();
+            job();
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                return;  // the next post will schedule us again
+            }
+        }
+        schedule();  // still pending, yield the worker to other strands
+    }
+
+    // Only called when pending > 0, so a node has been (or is being) pushed
+    std::function<void()> pop() {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        while (next == nullptr) {
+            // a producer has swapped head but not linked prev->next yet
+            std::this_thread::yield();
+            next = tail->next.load(std::memory_order_acquire);
+        }
+        if (tail != &stub) {
+            delete tail;
+        }
+        tail = next;  // next becomes the dummy node once we take its job
+        return std::move(next->job);
+    }
+
+    WorkerPool* pool;
+    Node stub{{nullptr}, {}};
+    std::atomic<Node*> head{&stub};  // producers push here
+    Node* tail{&stub};               // only the drain job touches this
+    std::atomic<int> pending{0};
+};
+
+// Maps keys to strands. Looking up an existing strand takes a shared lock on
+// the map; posting to the strand itself is lock-free, so callers that post a
+// lot to the same key should keep the Strand& (strands are never destroyed
+// before the map).
+template <typename Key, typename Hash = std::hash<Key>>
+class StrandMap {
+   public:
+    explicit StrandMap(WorkerPool* p) : pool(p) {}
+
+    Strand& get(const Key& key) {
+        {
+            std::shared_lock lck(map_mutex);
+            auto it = strands.find(key);
+            if (it != strands.end()) {
+                return *it->second;
+            }
+        }
+        std::unique_lock lck(map_mutex);
+        auto& strand = strands[key];  // someone might have beaten us to it
+        if (!strand) {
+            strand = std::make_unique<Strand>(pool);
+        }
+        return *strand;
+    }
+
+   private:
+    WorkerPool* pool;
+    std::shared_mutex map_mutex;
+    std::unordered_map<Key, std::unique_ptr<Strand>, Hash> strands;
+};
+
+#endif  // STRAND_H_
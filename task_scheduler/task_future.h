@@ -0,0 +1,251 @@
+/*
+    A lightweight future for the result of a scheduled task. The executing
+   thread (event loop or worker) fulfils it, and the client can poll ready(),
+   block in wait() or retrieve the value with get().
+
+   Unlike std::future, there is no mutex or condition variable per task:
+   1) The state machine is a single atomic int (EMPTY -> VALUE or EXCEPTION).
+   The producer writes the value and then publishes it with a release store;
+   the consumer reads the status with an acquire load before touching it.
+   2) Blocking uses C++20 std::atomic::wait/notify_all, which sleeps on the
+   atomic itself (a futex on Linux) instead of a per-task condition variable.
+   3) The shared state is reference counted intrusively and recycled through a
+   pool rather than freed, so steady-state scheduling does not allocate one.
+
+   The pool keeps a small free list per thread (no locking at all) and spills
+   to / refills from a global free list in batches when a thread runs out or
+   accumulates too many, since the consumer and producer of a state are often
+   different threads.
+
+   If the task never runs (deleted, or the scheduler shut down first), the
+   last copy of the producer handle breaks the promise, and get() throws.
+*/
+
+#ifndef TASK_FUTURE_H_
+#define TASK_FUTURE_H_
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+template <typename T>
+class FutureStatePool;
+
+template <typename T>
+struct FutureState {
+    // std::monostate lets us share one implementation with void tasks
+    using VType = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+    enum Status : int { EMPTY = 0, VALUE = 1, EXCEPTION = 2 };
+
+    std::atomic<int> status{EMPTY};
+    std::atomic<int> refs{0};       // producer copies + the consumer
+    std::atomic<int> producers{0};  // producer copies only
+    std::optional<VType> value;
+    std::exception_ptr error;
+
+    void reset() {
+        status.store(EMPTY, std::memory_order_relaxed);
+        value.reset();
+        error = nullptr;
+    }
+
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            FutureStatePool<T>::recycle(this);
+        }
+    }
+};
+
+template <typename T>
+class FutureStatePool {
+   public:
+    static FutureState<T>* request() {
+        auto& local = getLocal();
+        if (local.free.empty()) {
+            local.refill();
+        }
+        if (local.free.empty()) {
+            return new FutureState<T>();
+        }
+        auto state = local.free.back();
+        local.free.pop_back();
+        return state;
+    }
+
+    static void recycle(FutureState<T>* state) {
+        state->reset();
+        auto& local = getLocal();
+        local.free.push_back(state);
+        if (local.free.size() >= 2 * BATCH) {
+            local.spill(BATCH);
+        }
+    }
+
+   private:
+    static constexpr size_t BATCH = 64;
+
+    struct Global {
+        ~Global() {
+            for (auto state : free) {
+                delete state;
+            }
+        }
+        std::mutex mutex;
+        std::vector<FutureState<T>*> free;
+    };
+
+    struct Local {
+        ~Local() { spill(free.size()); }  // hand back when the thread exits
+
+        void refill() {
+            auto& global = getGlobal();
+            std::scoped_lock lck(global.mutex);
+            size_t n = std::min(BATCH, global.free.size());
+            free.insert(free.end(), global.free.end() - n, global.free.end());
+            global.free.resize(global.free.size() - n);
+        }
+
+        void spill(size_t n) {
+            auto& global = getGlobal();
+            std::scoped_lock lck(global.mutex);
+            global.free.insert(global.free.end(), free.end() - n, free.end());
+            free.resize(free.size() - n);
+        }
+
+        std::vector<FutureState<T>*> free;
+    };
+
+    // function-local statics so that the global list outlives thread caches
+    static Global& getGlobal() {
+        static Global global;
+        return global;
+    }
+    static Local& getLocal() {
+        getGlobal();  // construct first => destroyed last
+        static thread_local Local local;
+        return local;
+    }
+};
+
+// Held by the task. Copyable because Task (and std::function) must be.
+template <typename T>
+class TaskPromise {
+   public:
+    explicit TaskPromise(FutureState<T>* s) : state(s) {
+        state->producers.fetch_add(1, std::memory_order_relaxed);
+        state->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    TaskPromise(const TaskPromise& other) : TaskPromise(other.state) {}
+    TaskPromise& operator=(const TaskPromise& other) = delete;
+    ~TaskPromise() {
+        if (state->producers.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+            state->status.load(std::memory_order_acquire) ==
+                FutureState<T>::EMPTY) {
+            publish(FutureState<T>::EXCEPTION,
+                    std::make_exception_ptr(
+                        std::runtime_error("task was cancelled")));
+        }
+        state->release();
+    }
+
+    // Runs fn and stores its result or exception
+    template <typename F>
+    void fulfil(F& fn) {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                fn();
+                state->value.emplace();
+            } else {
+                state->value.emplace(fn());
+            }
+            publish(FutureState<T>::VALUE, nullptr);
+        } catch (...) {
+            publish(FutureState<T>::EXCEPTION, std::current_exception());
+        }
+    }
+
+   private:
+    void publish(int status, std::exception_ptr error) {
+        state->error = std::move(error);
+        state->status.store(status, std::memory_order_release);
+        state->status.notify_all();
+    }
+
+    FutureState<T>* state;
+};
+
+template <typename T>
+class TaskFuture {
+   public:
+    TaskFuture() = default;
+    explicit TaskFuture(FutureState<T>* s) : state(s) {
+        state->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    ~TaskFuture() {
+        if (state) {
+            state->release();
+        }
+    }
+    TaskFuture(const TaskFuture& other) = delete;
+    TaskFuture& operator=(const TaskFuture& other) = delete;
+    TaskFuture(TaskFuture&& other)
+        : state(std::exchange(other.state, nullptr)), id(other.id) {}
+    TaskFuture& operator=(TaskFuture&& other) {
+        if (this != &other) {
+            if (state) {
+                state->release();
+            }
+            state = std::exchange(other.state, nullptr);
+            id = other.id;
+        }
+        return *this;
+    }
+
+    // -1 if the scheduler refused the task (in which case get() throws)
+    int task_id() const { return id; }
+    void set_task_id(int task_id) { id = task_id; }
+
+    bool valid() const { return state != nullptr; }
+
+    bool ready() const {
+        return state->status.load(std::memory_order_acquire) !=
+               FutureState<T>::EMPTY;
+    }
+
+    void wait() const {
+        // returns immediately unless the status is still EMPTY
+        state->status.wait(FutureState<T>::EMPTY, std::memory_order_acquire);
+    }
+
+    // Blocks until the task has run. May only be called once.
+    T get() {
+        wait();
+        if (state->status.load(std::memory_order_acquire) ==
+            FutureState<T>::EXCEPTION) {
+            std::rethrow_exception(state->error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*state->value);
+        }
+    }
+
+   private:
+    FutureState<T>* state{nullptr};
+    int id{-1};
+};
+
+// Both handles share a pooled state. The promise goes into the task.
+template <typename T>
+std::pair<TaskFuture<T>, TaskPromise<T>> makeFuturePair() {
+    auto state = FutureStatePool<T>::request();
+    return {TaskFuture<T>(state), TaskPromise<T>(state)};
+}
+
+#endif  // TASK_FUTURE_H_
@@ -0,0 +1,182 @@
+/*
+    A task graph is a DAG of callables that is triggered as a whole. Each node
+   becomes runnable once all of its predecessors have finished, so a pipeline
+   like "snapshot books -> compute analytics -> publish" no longer has to be
+   expressed as separate timed tasks with guessed offsets: the critical path of
+   the graph determines when the last node finishes.
+
+   The graph itself is immutable once built and can be triggered many times.
+   Every trigger creates a GraphRun that holds the per-run state:
+   1) one atomic counter per node with the number of predecessors that have
+   not finished yet. The thread that brings a counter to zero is the one that
+   makes the node runnable, so no lock is needed to decide who runs what.
+   2) one atomic counter of nodes that have not finished yet. The thread that
+   brings it to zero runs the completion callback.
+
+   Ready nodes are submitted to a WorkerPool and therefore run in parallel. As
+   a small optimization, a worker that finishes a node keeps one of the newly
+   ready successors for itself instead of bouncing it through the pool queue.
+   Without a pool the graph is executed on the calling thread in a topological
+   order.
+*/
+
+#ifndef TASK_GRAPH_H_
+#define TASK_GRAPH_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "worker_pool.h"
+
+class TaskGraph {
+   public:
+    using NodeId = int;
+
+    // Returns the id of the new node, to be used in addEdge
+    NodeId addNode(std::function<void()> fn) {
+        nodes.push_back({std::move(fn), {}, 0});
+        return static_cast<NodeId>(nodes.size()) - 1;
+    }
+
+    // Makes `after` wait for `before`. Returns false if either id is invalid.
+    bool addEdge(NodeId before, NodeId after) {
+        if (!getIsNodeValid(before) || !getIsNodeValid(after) ||
+            before == after) {
+            return false;
+        }
+        nodes[before].successors.push_back(after);
+        ++nodes[after].num_predecessors;
+        return true;
+    }
+
+    size_t size() const { return nodes.size(); }
+
+    // Kahn's algorithm: a graph is acyclic iff every node can be peeled off
+    bool getIsAcyclic() const {
+        std::vector<int> pending(nodes.size());
+        std::vector<NodeId> ready;
+        for (NodeId i = 0; i < static_cast<NodeId>(nodes.size()); ++i) {
+            pending[i] = nodes[i].num_predecessors;
+            if (pending[i] == 0) {
+                ready.push_back(i);
+            }
+        }
+        size_t num_visited = 0;
+        while (!ready.empty()) {
+            NodeId curr = ready.back();
+            ready.pop_back();
+            ++num_visited;
+            for (NodeId s : nodes[curr].successors) {
+                if (--pending[s] == 0) {
+                    ready.push_back(s);
+                }
+            }
+        }
+        return num_visited == nodes.size();
+    }
+
+    // Runs the graph once. Returns immediately if a pool is given, otherwise
+    // returns after every node has run on the calling thread. on_complete runs
+    // on whichever thread finishes the last node. The graph must be acyclic.
+    static void launch(std::shared_ptr<const TaskGraph> graph, WorkerPool* pool,
+                       std::function<void()> on_complete = {}) {
+        auto run = std::make_shared<GraphRun>(std::move(graph), pool,
+                                              std::move(on_complete));
+        if (run->graph->nodes.empty()) {
+            run->complete();
+            return;
+        }
+        std::vector<NodeId> roots;
+        for (NodeId i = 0; i < static_cast<NodeId>(run->graph->size()); ++i) {
+            if (run->graph->nodes[i].num_predecessors == 0) {
+                roots.push_back(i);
+            }
+        }
+        if (pool == nullptr) {
+            // the roots act as the initial work list
+            runFrom(run, std::move(roots));
+            return;
+        }
+        for (NodeId root : roots) {
+            pool->submit([run, root]() { runFrom(run, {root}); });
+        }
+    }
+
+   private:
+    struct Node {
+        std::function<void()> fn;
+        std::vector<NodeId> successors;
+        int num_predecessors;
+    };
+
+    struct GraphRun {
+        GraphRun(std::shared_ptr<const TaskGraph> g, WorkerPool* p,
+                 std::function<void()> c)
+            : graph(std::move(g)),
+              pool(p),
+              on_complete(std::move(c)),
+              pending(new std::atomic<int>[graph->size()]),
+              remaining(static_cast<int>(graph->size())) {
+            for (size_t i = 0; i < graph->size(); ++i) {
+                pending[i].store(graph->nodes[i].num_predecessors,
+                                 std::memory_order_relaxed);
+            }
+        }
+
+        void complete() {
+            if (on_complete) {
+                on_complete();
+            }
+        }
+
+        std::shared_ptr<const TaskGraph> graph;
+        WorkerPool* pool;
+        std::function<void()> on_complete;
+        // std::atomic is neither copyable nor movable, so no std::vector here
+        std::unique_ptr<std::atomic<int>[]> pending;
+        std::atomic<int> remaining;
+    };
+
+    // Runs the nodes in work_list and everything they make ready. With a pool
+    // we keep one ready successor and hand the others to the pool; without a
+    // pool we keep all of them.
+    static void runFrom(const std::shared_ptr<GraphRun>& run,
+                        std::vector<NodeId> work_list) {
+        const auto& nodes = run->graph->nodes;
+        while (!work_list.empty()) {
+            NodeId curr = work_list.back();
+            work_list.pop_back();
+            if (nodes[curr].fn) {
+                nodes[curr].fn();
+            }
+            bool kept_one = false;
+            for (NodeId s : nodes[curr].successors) {
+                // acq_rel: the successor must see the writes of every
+                // predecessor, and the last predecessor is the one to see 1
+                if (run->pending[s].fetch_sub(1, std::memory_order_acq_rel) !=
+                    1) {
+                    continue;
+                }
+                if (run->pool == nullptr || !kept_one) {
+                    work_list.push_back(s);
+                    kept_one = true;
+                } else {
+                    run->pool->submit([run, s]() { runFrom(run, {s}); });
+                }
+            }
+            if (run->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                run->complete();
+            }
+        }
+    }
+
+    bool getIsNodeValid(NodeId id) const {
+        return id >= 0 && id < static_cast<NodeId>(nodes.size());
+    }
+
+    std::vector<Node> nodes;
+};
+
+#endif  // TASK_GRAPH_H_
@@ -6,22 +6,109 @@
    tasks are due to be executed, the scheduler sleeps until a new task is added
    that should be executed before the earliest existing task. In particular, the
    scheduler does not wake up every 100ms or so to check its state.
+
+   Optionally, the scheduler owns a pool of worker threads. The event loop then
+   only hands due tasks to the pool instead of running them itself, so a long
+   running task does not delay the tasks behind it. Whole DAGs of tasks can be
+   scheduled as a unit (see task_graph.h): the graph is launched at its trigger
+   time and each node runs on the pool as soon as its predecessors are done.
+
+   Tasks can also be plain callables. Their result is delivered either through
+   a TaskFuture (see task_future.h) or to a continuation that runs on the
+   executing thread right after the task.
+
+   The scheduler keeps its own metrics (see scheduler_metrics.h): start
+   lateness, run time, queue depth, wakeups and lock hold time. They can be
+   read at any time without locking, and optionally a snapshot is handed to a
+   sink at a fixed interval by an internal repeated task (task_id 0).
+
+   Each task may declare a slack: it must start within [start_time, start_time
+   + slack]. The event loop sleeps until the earliest deadline (start_time +
+   slack) rather than the earliest start_time, and then runs every task whose
+   start_time has passed. Thousands of heartbeats that are a few ms apart but
+   tolerate some delay thus share one wakeup instead of causing one each.
+
+   Optionally, single and repeated tasks that are not arbitrary callables (the
+   simulated ones, and those running a handler registered by id) are written
+   to a persistent log (see schedule_log.h). After a restart, the scheduler
+   rebuilds its queue from the log in one bulk load (std::make_heap) and deals
+   with the runs it missed according to a MissedRunPolicy.
+
+   Tasks live in the slots of a slab (see task_slab.h) that are recycled once
+   a task has run or was deleted, and the queue is a heap of pointers to
+   them, with an index by task_id for deletion. Scheduling, running and
+   deleting a task thus cost no allocation once the slab has grown to the
+   peak number of tasks, as long as the task's callable fits in
+   std::function's inline buffer (e.g. a lambda capturing one or two
+   pointers) and it has no future or stop state.
+
+   Tasks can be tagged with a key (e.g. a symbol). Tasks with the same key run
+   in the order they become due and never concurrently, while tasks with
+   different keys still run in parallel on the pool (see strand.h). Tasks that
+   are due at the same time become due in the order they were scheduled.
+
+   A task running on the pool can fan out over all workers with parallelFor or
+   a TaskGroup (see fork_join.h).
+
+   Optionally, the event loop sleeps in epoll instead of on q_cvar (see
+   epoll_reactor.h), and then also runs callbacks for file descriptors that
+   become ready. Timers, fd callbacks and tasks (without workers) then all
+   share the one loop thread.
+
+   The queue can be bounded, as a whole and per task class (a small int the
+   client picks, e.g. one for market data catch-up tasks). When a limit is
+   hit, a new task is rejected, replaces the earliest-due task of the class,
+   or blocks its producer for a while (see QueueLimit). Shed tasks are counted
+   in the metrics, so overload shows up as numbers rather than as memory.
+   A class can also be rate-limited with a token bucket (see token_bucket.h):
+   a due task whose bucket is empty is not run but deferred, once, to the
+   exact time the next token that no other deferred task has claimed arrives.
+
+   A cancellable task receives a std::stop_token. Deleting it while it runs
+   (or shutting down while it is dispatched) requests a stop, which the task
+   is expected to check now and then and return early. The time from the
+   request to the task's return is recorded as the cancellation latency.
+
+   Repeated tasks can also follow a calendar rule (see recurrence_rule.h), e.g.
+   every 5 minutes during trading hours on exchange days. After each run the
+   next start time comes from the rule instead of a fixed repeat_interval.
 */
 
+#ifndef TASK_SCHEDULER_H_
+#define TASK_SCHEDULER_H_
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <concepts>
 #include <condition_variable>
 #include <ctime>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <stop_token>
 #include <thread>
 #include <unordered_map>
-#include <unordered_set>
+
+#include "epoll_reactor.h"
+#include "fork_join.h"
+#include "recurrence_rule.h"
+#include "task_future.h"
+#include "schedule_log.h"
+#include "scheduler_metrics.h"
+#include "strand.h"
+#include "task_graph.h"
+#include "task_slab.h"
+#include "token_bucket.h"
+#include "worker_pool.h"
 
 namespace ns = std::chrono;  // similar to Python's datetime class
-std::string printTime() {
+inline std::string printTime() {
     auto now = ns::system_clock::now();
     // auto curr_t = ns::system_clock::to_time_t(now); // only gets seconds
     // std::cout << std::put_time(std::localtime(&curr_t), *) << std::endl;
@@ -37,138 +124,682 @@ struct Task {
     ns::system_clock::time_point start_time;
     ns::milliseconds running_time;
     // ns::milliseconds repeat_interval{0}; // we now store in the unordered map
+    std::function<void()> fn;  // if empty, we simulate work for running_time
+    ns::milliseconds slack{0};  // the task may start this much after start_time
+    Strand* strand{nullptr};    // if set, run serially with its other tasks
+    int task_class{0};          // for admission control, see QueueLimit
+    // only cancellable tasks have a stop state (which is an allocation)
+    std::stop_source stop{std::nostopstate};
+    size_t heap_idx{0};  // position in taskq, see IntrusiveHeap
+    bool has_token{false};  // reserved when it was rate-limited
+    size_t class_heap_idx{0};  // position in oldest_by_class, if there
 
     void run() {
-        // Simulate a possibly long-running function
-        std::this_thread::sleep_for(running_time);
-        std::cout << printTime() << "Finished task " << task_id << std::endl;
+        if (fn) {
+            fn();
+        } else {
+            // Simulate a possibly long-running function
+            std::this_thread::sleep_for(running_time);
+        }
     }
     bool operator<(const Task& other) const {
-        return this->start_time > other.start_time;  // small t = high priority
+        if (this->start_time != other.start_time) {
+            return this->start_time > other.start_time;  // small t = high prio
+        }
+        return this->task_id > other.task_id;  // FIFO among equal start times
     }
 };
 
+// What a producer gets when its task would exceed a queue limit
+enum class OverflowPolicy {
+    REJECT,       // the new task is refused (task_id -1)
+    DROP_OLDEST,  // the earliest-due single task of the class is dropped
+    BLOCK,        // the producer waits up to block_timeout, then is refused
+};
+
+struct QueueLimit {
+    size_t max_queued{0};  // 0 = unlimited
+    OverflowPolicy overflow{OverflowPolicy::REJECT};
+    ns::milliseconds block_timeout{100};
+};
+
+struct SchedulerOptions {
+    // MAX_DURATION for which the task scheduler is allowed to run
+    ns::milliseconds max_duration{4000};
+    // 0 = run tasks on the event loop thread itself
+    size_t num_workers{0};
+    // false = no log lines (use the metrics instead)
+    bool verbose{true};
+    // if both are set, metrics_sink receives a snapshot every metrics_interval
+    ns::milliseconds metrics_interval{0};
+    std::function<void(const MetricsSnapshot&)> metrics_sink;
+    // if set, persistent tasks are logged to files starting with log_path and
+    // recovered from them on construction
+    std::string log_path;
+    size_t snapshot_every{10000};  // log records between snapshots
+    MissedRunPolicy missed_run_policy{MissedRunPolicy::SKIP};
+    // callables that persistent tasks refer to by id (see scheduleHandler)
+    std::unordered_map<int, std::function<void()>> handlers;
+    bool use_epoll{false};  // see watchFd
+    // bounds on the whole queue and on the tasks of a given class
+    QueueLimit queue_limit{};
+    std::unordered_map<int, QueueLimit> class_limits;
+    // token buckets of rate-limited classes (per_second > 0 and burst >= 1,
+    // else the constructor throws std::invalid_argument); later iterations
+    // of a deferred repeated task keep its new phase
+    std::unordered_map<int, RateLimit> class_rates;
+    // if >= 0, the event loop thread is pinned to this CPU
+    int cpu{-1};
+};
+
+// A scoped lock that records how long it was held. Also a BasicLockable, so
+// that a producer can wait on a condition_variable_any while holding it.
+class TimedLock {
+   public:
+    TimedLock(std::mutex& m, LatencyHistogram& h)
+        : lck(m), hist(h), locked_at(ns::steady_clock::now()) {}
+    ~TimedLock() { hist.record(ns::steady_clock::now() - locked_at); }
+
+    void lock() {
+        lck.lock();
+        locked_at = ns::steady_clock::now();
+    }
+    void unlock() {
+        hist.record(ns::steady_clock::now() - locked_at);
+        lck.unlock();
+    }
+
+   private:
+    std::unique_lock<std::mutex> lck;
+    LatencyHistogram& hist;
+    ns::steady_clock::time_point locked_at;
+};
+
 class TaskScheduler {
    public:
     // https://en.cppreference.com/w/cpp/language/pointer#Pointers_to_members
     // https://stackoverflow.com/questions/10673585/start-thread-with-member-function
-    TaskScheduler(ns::system_clock::time_point s)
-        : start(s), event_loop_thread(&TaskScheduler::runEventLoop, this) {}
+    TaskScheduler(ns::system_clock::time_point s, SchedulerOptions opts = {})
+        : start(s),
+          MAX_DURATION(opts.max_duration),
+          verbose(opts.verbose),
+          metrics_interval(opts.metrics_interval),
+          metrics_sink(std::move(opts.metrics_sink)),
+          handlers(std::move(opts.handlers)),
+          queue_limit(opts.queue_limit),
+          class_limits(std::move(opts.class_limits)),
+          schedule_log(opts.log_path.empty()
+                           ? nullptr
+                           : std::make_unique<ScheduleLog>(
+                                 opts.log_path, opts.snapshot_every)),
+          reactor(opts.use_epoll ? std::make_unique<EpollReactor>() : nullptr),
+          workers(opts.num_workers > 0
+                      ? std::make_unique<WorkerPool>(opts.num_workers)
+                      : nullptr),
+          strands(workers.get()) {
+        for (const auto& [task_class, rate] : opts.class_rates) {
+            buckets.try_emplace(task_class, rate);
+        }
+        for (const auto& [task_class, limit] : class_limits) {
+            if (limit.overflow == OverflowPolicy::DROP_OLDEST) {
+                oldest_by_class.try_emplace(task_class);
+            }
+        }
+        if (schedule_log) {
+            recoverSchedule(opts.missed_run_policy);
+        }
+        // Only start the event loop once the recovered queue is in place. The
+        // thread does not exist yet so we need no lock, and clients can
+        // schedule tasks as soon as the constructor returns.
+        event_loop_running = true;
+        event_loop_thread = std::thread(&TaskScheduler::runEventLoop, this);
+        if (opts.cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(opts.cpu, &cpus);
+            if (pthread_setaffinity_np(event_loop_thread.native_handle(),
+                                       sizeof(cpus), &cpus) != 0) {
+                log("ERROR: cannot pin the event loop to CPU ", opts.cpu);
+            }
+        }
+    }
 
     ~TaskScheduler() {
-        std::cout << printTime() << "Ending the event loop" << std::endl;
+        log("Ending the event loop");
         event_loop_thread.join();
-        std::cout << printTime() << "Destroying the task scheduler"
-                  << std::endl;
+        workers.reset();  // drain jobs still use the strands
+        log("Destroying the task scheduler");
     }
 
-    // Returns task_id of a job to be run once at start_time
+    // Returns task_id of a job to be run once at start_time (but not later
+    // than start_time + slack, to allow it to share a wakeup with other tasks)
     int scheduleTask(ns::system_clock::time_point start_time,
-                     ns::milliseconds running_time) {
-        std::scoped_lock lck(q_mutex);
-        if (!get_event_loop_running()) {
+                     ns::milliseconds running_time,
+                     ns::milliseconds slack = ns::milliseconds{0}) {
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        int task_id =
+            addTask(lck, "single", start_time, running_time, {}, slack);
+        persist(task_id, -1, start_time, ns::milliseconds{0}, running_time,
+                slack);
+        return task_id;
+    }
+
+    // Runs fn once at start_time. The returned future holds fn's result (or
+    // exception) and the task_id. If the task is deleted or never scheduled,
+    // get() throws.
+    template <typename F>
+        requires std::invocable<F&>
+    TaskFuture<std::invoke_result_t<F&>> scheduleTask(
+        ns::system_clock::time_point start_time, F&& fn) {
+        using RType = std::invoke_result_t<F&>;
+        auto [future, promise] = makeFuturePair<RType>();
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        future.set_task_id(addTask(
+            lck, "future", start_time, ns::milliseconds{0},
+            [promise, fn = std::forward<F>(fn)]() mutable {
+                promise.fulfil(fn);
+            }));
+        return future;
+    }
+
+    // Runs fn once at start_time and then passes its result to on_done, on the
+    // same thread and without any synchronization in between
+    template <typename F, typename C>
+        requires std::invocable<F&>
+    int scheduleTask(ns::system_clock::time_point start_time, F&& fn,
+                     C&& on_done) {
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        return addTask(
+            lck, "continuation", start_time, ns::milliseconds{0},
+            [fn = std::forward<F>(fn),
+             on_done = std::forward<C>(on_done)]() mutable {
+                if constexpr (std::is_void_v<std::invoke_result_t<F&>>) {
+                    fn();
+                    on_done();
+                } else {
+                    on_done(fn());
+                }
+            });
+    }
+
+    // Runs fn once at start_time, after every task with the same key that
+    // became due earlier has finished, and never in parallel with them
+    int scheduleOnStrand(const std::string& key,
+                         ns::system_clock::time_point start_time,
+                         std::function<void()> fn) {
+        Strand& strand = strands.get(key);  // before q_mutex: may take a lock
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        return addTask(lck, "strand", start_time, ns::milliseconds{0},
+                       std::move(fn), ns::milliseconds{0}, ns::milliseconds{0},
+                       &strand);
+    }
+
+    // Runs fn once at start_time, subject to the limits of task_class (see
+    // SchedulerOptions::class_limits). Returns -1 if the task was shed.
+    int scheduleInClass(int task_class, ns::system_clock::time_point start_time,
+                        std::function<void()> fn,
+                        ns::milliseconds slack = ns::milliseconds{0}) {
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        return addTask(lck, "classed", start_time, ns::milliseconds{0},
+                       std::move(fn), slack, ns::milliseconds{0}, nullptr,
+                       task_class);
+    }
+
+    // Runs fn(token) once at start_time, or every repeat_interval if that is
+    // not 0. If the task is deleted while it runs, or the scheduler shuts down
+    // first, a stop is requested on the token.
+    int scheduleCancellable(
+        ns::system_clock::time_point start_time,
+        std::function<void(std::stop_token)> fn,
+        ns::milliseconds repeat_interval = ns::milliseconds{0}) {
+        std::stop_source stop;
+        auto run = [fn = std::move(fn), token = stop.get_token()]() {
+            fn(token);
+        };
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        return addTask(lck, "cancellable", start_time, ns::milliseconds{0},
+                       std::move(run), ns::milliseconds{0}, repeat_interval,
+                       nullptr, 0, std::move(stop));
+    }
+
+    // Runs fn at every fire time of rule, starting with the first one after
+    // now. Returns -1 if there is no rule (e.g. fromCron failed) or it never
+    // fires within its horizon.
+    int scheduleRecurring(std::shared_ptr<const RecurrenceRule> rule,
+                          std::function<void()> fn,
+                          ns::milliseconds slack = ns::milliseconds{0}) {
+        if (!rule) {
+            log("ERROR: no recurrence rule");
             return -1;
         }
-        std::cout << printTime() << "Adding task " << next_task_id
-                  << " (single) to the queue" << std::endl;
-
-        // aggregate initialization allows us to specify first few fields only
-        // https://softwareengineering.stackexchange.com/questions/262463/should-we-add-constructors-to-structs
-        taskq.emplace(next_task_id, start_time, running_time);
-        q_cvar.notify_one();  // proactively notify and let event loop check
-        return next_task_id++;
+        auto first = rule->getNextFire(ns::system_clock::now());
+        if (first == ns::system_clock::time_point::max()) {
+            log("ERROR: recurrence rule never fires");
+            return -1;
+        }
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        // still under q_mutex, so the rule is in place before the task can run
+        int task_id = addTask(lck, "recurring", first, ns::milliseconds{0},
+                              std::move(fn), slack);
+        if (task_id >= 0) {
+            recurrence_rules.insert_or_assign(task_id, std::move(rule));
+        }
+        return task_id;
     }
 
-    // Returns task_id which remains the same each time the same task is run
+    // Returns task_id which remains the same each time the same task is run.
+    // The slack applies to every iteration, which are still repeat_interval
+    // apart in terms of start_time (i.e. running late does not cause a drift).
     int scheduleRepeated(ns::system_clock::time_point start_time,
                          ns::milliseconds repeat_interval,
-                         ns::milliseconds running_time) {
-        std::scoped_lock lck(q_mutex);
-        if (!get_event_loop_running()) {
+                         ns::milliseconds running_time,
+                         ns::milliseconds slack = ns::milliseconds{0}) {
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        int task_id = addTask(lck, "repeated", start_time, running_time, {},
+                              slack, repeat_interval);
+        persist(task_id, -1, start_time, repeat_interval, running_time, slack);
+        return task_id;
+    }
+
+    // Runs the callable registered as SchedulerOptions::handlers[handler] once
+    // at start_time, or every repeat_interval if that is not 0. Returns -1 if
+    // there is no such handler. Unlike tasks with arbitrary callables, these
+    // tasks are persisted (if a log_path was given).
+    int scheduleHandler(int handler, ns::system_clock::time_point start_time,
+                        ns::milliseconds repeat_interval = ns::milliseconds{0},
+                        ns::milliseconds slack = ns::milliseconds{0}) {
+        auto it = handlers.find(handler);
+        if (it == handlers.end()) {
+            log("ERROR: handler ", handler, " not found");
             return -1;
         }
-        std::cout << printTime() << "Adding task " << next_task_id
-                  << " (repeated) to the queue" << std::endl;
-        taskq.emplace(next_task_id, start_time, running_time);
-        repeated_tasks.insert_or_assign(next_task_id, repeat_interval);
-        q_cvar.notify_one();  // proactively notify and let event loop check
-        return next_task_id++;
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        int task_id = addTask(lck, "handler", start_time, ns::milliseconds{0},
+                              it->second, slack, repeat_interval);
+        persist(task_id, handler, start_time, repeat_interval,
+                ns::milliseconds{0}, slack);
+        return task_id;
+    }
+
+    // Returns task_id of a graph to be launched once at trigger_time, or -1 if
+    // the graph has a cycle. on_complete runs after the last node has finished.
+    int scheduleGraph(ns::system_clock::time_point trigger_time,
+                      std::shared_ptr<const TaskGraph> graph,
+                      std::function<void()> on_complete = {}) {
+        if (!graph || !graph->getIsAcyclic()) {
+            log("ERROR: task graph is not a DAG");
+            return -1;
+        }
+        TimedLock lck(q_mutex, metrics.lock_hold);
+        // launching only submits the roots when we have workers, so the event
+        // loop (or the worker that launches) is never blocked by the graph
+        return addTask(lck, "graph", trigger_time, ns::milliseconds{0},
+                       [pool = workers.get(), graph = std::move(graph),
+                        on_complete = std::move(on_complete)]() {
+                           TaskGraph::launch(graph, pool, on_complete);
+                       });
     }
 
     bool deleteScheduled(int task_id) {
-        std::scoped_lock lck(q_mutex);
+        TimedLock lck(q_mutex, metrics.lock_hold);
         if (!get_event_loop_running()) {
             return false;
         }
         bool ok = false;
-        if (repeated_tasks.find(task_id) != repeated_tasks.end()) {
+        if (isRepeated(task_id)) {
             // To delete a repeated task, we will first stop the repetition and
             // and then cancel the upcoming iteration if it's not running
             repeated_tasks.erase(task_id);
+            recurrence_rules.erase(task_id);
             ok = true;
         }
-        if ((!ok) && executed_tasks.find(task_id) != executed_tasks.end()) {
-            // However, if a single task has run, report an error
-            std::cout << printTime() << "ERROR: task " << task_id
-                      << " has been executed" << std::endl;
-            return false;
+        if (auto it = running.find(task_id); it != running.end()) {
+            // too late to take it off the queue, but it can return early
+            log("Cancelling running task ", task_id);
+            requestStop(it->second);
+            return true;
         }
 
         // Here we find and cancel the next iteration of single or repeated task
-        {
-            // a std::priority_queue restricts access to underlying data, so we
-            // have to search through it one by one (we don't face the same
-            // issue if we call std::make_heap, std::heap_pop, std::heap_push
-            // directly on a vector without overlaying an adapter class)
-            std::vector<Task> tasks;
-            tasks.reserve(taskq.size());  // we want to set capacity not size
-            while ((!taskq.empty()) && taskq.top().task_id != task_id) {
-                tasks.push_back(std::move(taskq.top()));
-                taskq.pop();
-            }
-            if ((!taskq.empty()) && taskq.top().task_id == task_id) {
-                taskq.pop();  // this is the one we want to delete
-                ok = true;
-            }
-            // in either case, put the rest back
-            for (const auto& task : tasks) {
-                taskq.push(std::move(task));
-            }
+        // The index finds it in O(1) and, since every task knows its position
+        // in the heap, it is then removed in O(log n)
+        if (Task* t = queued.find(task_id)) {
+            eraseTask(t);
+            ok = true;
         }
         if (!ok) {
-            std::cout << printTime() << "ERROR: task " << task_id
-                      << " not found" << std::endl;
+            // e.g. a single task that has run (or is running) already
+            log("ERROR: task ", task_id, " not found");
+            return false;
+        }
+        log("Deleting task ", task_id);
+        if (schedule_log) {
+            schedule_log->appendRemove(task_id);
+        }
+        wakeLoop();  // proactively notify and let event loop check
+        return true;
+    }
+
+    // Calls on_ready(events) on the event loop thread whenever fd becomes
+    // ready for any of events (EPOLLIN etc., level-triggered unless EPOLLET).
+    // Only with use_epoll. Returns false if not possible.
+    bool watchFd(int fd, uint32_t events,
+                 std::function<void(uint32_t)> on_ready) {
+        if (!reactor) {
+            log("ERROR: watchFd needs use_epoll");
+            return false;
+        }
+        if (!reactor->add(fd, events, std::move(on_ready))) {
+            log("ERROR: cannot watch fd ", fd);
             return false;
         }
-        std::cout << printTime() << "Deleting task " << task_id << std::endl;
-        q_cvar.notify_one();  // proactively notify and let event loop check
         return true;
     }
 
+    // No callback for fd runs after this returns, except one that is running
+    bool unwatchFd(int fd) { return reactor && reactor->remove(fd); }
+
+    // Safe to call from any thread at any time (no locking)
+    const SchedulerMetrics& getMetrics() const { return metrics; }
+    MetricsSnapshot getMetricsSnapshot() const { return metrics.snapshot(); }
+
    private:
+    template <typename... Args>
+    void log(const Args&... args) {
+        if (verbose) {
+            ((std::cout << printTime()) << ... << args) << std::endl;
+        }
+    }
+
+    // Must hold q_mutex through lck (which admit may release while blocked).
+    // Returns the new task_id, or -1 if not running or the task was shed.
+    int addTask(TimedLock& lck, const char* kind,
+                ns::system_clock::time_point start_time,
+                ns::milliseconds running_time, std::function<void()> fn = {},
+                ns::milliseconds slack = ns::milliseconds{0},
+                ns::milliseconds repeat_interval = ns::milliseconds{0},
+                Strand* strand = nullptr, int task_class = 0,
+                std::stop_source stop = std::stop_source{std::nostopstate}) {
+        if (!get_event_loop_running() || !admit(lck, task_class)) {
+            return -1;
+        }
+        log("Adding task ", next_task_id, " (", kind, ") to the queue");
+
+        // aggregate initialization allows us to specify first few fields only
+        // https://softwareengineering.stackexchange.com/questions/262463/should-we-add-constructors-to-structs
+        Task* t = task_pool.acquire();
+        *t = {next_task_id, start_time, running_time, std::move(fn), slack,
+              strand, task_class, std::move(stop)};
+        if (repeat_interval > ns::milliseconds{0}) {
+            repeated_tasks.insert_or_assign(next_task_id, repeat_interval);
+        }
+        pushTask(t);
+        wakeLoop();  // proactively notify and let event loop check
+        return next_task_id++;
+    }
+
+    // Must hold q_mutex through lck. Makes room for one more task of
+    // task_class according to the limits it would exceed, or returns false.
+    // Only new tasks are subject to limits: a repeated task that has run is
+    // always put back, and so are recovered tasks.
+    bool admit(TimedLock& lck, int task_class) {
+        auto it = class_limits.find(task_class);
+        const QueueLimit* class_limit =
+            it == class_limits.end() ? nullptr : &it->second;
+        auto is_full = [&](const QueueLimit* limit) {
+            if (limit == &queue_limit) {
+                return limit->max_queued > 0 &&
+                       taskq.size() >= limit->max_queued;
+            }
+            return limit && limit->max_queued > 0 &&
+                   class_depth[task_class] >= limit->max_queued;
+        };
+        bool blocked = false;
+        ns::steady_clock::time_point give_up;
+        while (true) {
+            const QueueLimit* limit = is_full(class_limit)    ? class_limit
+                                      : is_full(&queue_limit) ? &queue_limit
+                                                              : nullptr;
+            if (!limit) {
+                return true;
+            }
+            if (limit->overflow == OverflowPolicy::DROP_OLDEST &&
+                dropOldest(limit == class_limit ? task_class : -1)) {
+                metrics.recordDropped();
+                continue;
+            }
+            // The loop and the workers are what make room, so they must
+            // never wait for it
+            bool may_block =
+                !isLoopThread() &&
+                (!workers || WorkerPool::getCurrent() != workers.get());
+            if (limit->overflow != OverflowPolicy::BLOCK || !may_block) {
+                log("Rejecting a task of class ", task_class, ": queue full");
+                metrics.recordRejected();
+                return false;
+            }
+            if (!blocked) {
+                blocked = true;
+                metrics.recordBlocked();
+                give_up = ns::steady_clock::now() + limit->block_timeout;
+            }
+            ++num_blocked;
+            bool has_room = space_cvar.wait_until(lck, give_up, [&]() {
+                return !event_loop_running || !is_full(limit);
+            });
+            --num_blocked;
+            if (!event_loop_running) {
+                return false;
+            }
+            if (!has_room) {
+                log("Rejecting a task of class ", task_class, ": timed out");
+                metrics.recordRejected();
+                return false;
+            }
+        }
+    }
+
+    // Must hold q_mutex. Drops the earliest-due single task of task_class (or
+    // of any class if -1). Repeated tasks are never dropped, since that would
+    // silently end the repetition. A class with a DROP_OLDEST limit has its
+    // droppable tasks in a heap of their own. For the whole queue, the first
+    // task is the one unless it is repeated, and only then is it scanned.
+    bool dropOldest(int task_class) {
+        Task* victim = nullptr;
+        if (task_class >= 0) {
+            auto& oldest = oldest_by_class.at(task_class);
+            // scheduleRecurring makes a task repeated once it is queued
+            while (!oldest.empty() && !isDroppable(oldest.front())) {
+                oldest.erase(oldest.front());
+            }
+            victim = oldest.empty() ? nullptr : oldest.front();
+        } else if (isDroppable(taskq.front())) {
+            victim = taskq.front();
+        } else {
+            for (Task* t : taskq) {
+                if (isDroppable(t) && (!victim || *victim < *t)) {
+                    victim = t;
+                }
+            }
+        }
+        if (!victim) {
+            return false;
+        }
+        log("Dropping task ", victim->task_id);
+        if (schedule_log) {
+            schedule_log->appendRemove(victim->task_id);
+        }
+        eraseTask(victim);  // a pending future learns it was cancelled
+        return true;
+    }
+
+    // Must hold q_mutex. Makes the event loop re-check the queue.
+    void wakeLoop() {
+        if (!reactor) {
+            q_cvar.notify_one();
+        } else if (!isLoopThread()) {
+            // from a fd callback, the loop re-checks the queue anyway
+            reactor->wake();
+        }
+    }
+
+    // The constructor assigns event_loop_thread while the loop may already be
+    // running and clients calling in, so they compare against the id that the
+    // loop publishes itself instead
+    bool isLoopThread() const {
+        return std::this_thread::get_id() ==
+               event_loop_id.load(std::memory_order_relaxed);
+    }
+
+    // Same contract as q_cvar.wait_until: returns pred() once pred() is true
+    // or next_time has passed. With epoll, fd callbacks run in between
+    // (without the lock), and each return from epoll counts as a wakeup.
+    template <typename Pred>
+    bool waitUntil(std::unique_lock<std::mutex>& lck,
+                   ns::system_clock::time_point next_time, Pred pred) {
+        if (!reactor) {
+            return q_cvar.wait_until(lck, next_time, pred);
+        }
+        while (!pred()) {
+            if (ns::system_clock::now() >= next_time) {
+                return false;
+            }
+            lck.unlock();
+            reactor->poll(next_time);
+            lck.lock();
+        }
+        return true;
+    }
+
+    // Must hold q_mutex
+    void persist(int task_id, int handler,
+                 ns::system_clock::time_point start_time,
+                 ns::milliseconds repeat_interval,
+                 ns::milliseconds running_time, ns::milliseconds slack) {
+        if (task_id > 0 && schedule_log) {
+            schedule_log->appendSchedule({task_id, handler, toMs(start_time),
+                                          repeat_interval.count(),
+                                          running_time.count(), slack.count()});
+        }
+    }
+
+    // Called before the event loop starts, so no locking needed
+    void recoverSchedule(MissedRunPolicy policy) {
+        auto now_ms = toMs(ns::system_clock::now());
+        auto records = schedule_log->recover();
+        next_task_id = std::max(next_task_id, schedule_log->getMaxTaskId() + 1);
+        for (auto r : records) {
+            std::function<void()> fn;
+            if (r.handler >= 0) {
+                auto it = handlers.find(r.handler);
+                if (it == handlers.end()) {
+                    log("ERROR: handler ", r.handler, " of task ", r.task_id,
+                        " not found");
+                    schedule_log->appendRemove(r.task_id);
+                    continue;
+                }
+                fn = it->second;
+            }
+            if (r.start_ms < now_ms && r.interval_ms == 0 &&
+                policy == MissedRunPolicy::SKIP) {
+                schedule_log->appendRemove(r.task_id);
+                continue;
+            }
+            if (r.start_ms < now_ms && r.interval_ms > 0 &&
+                policy != MissedRunPolicy::RUN_ALL) {
+                // number of iterations that should have started before now
+                int64_t missed = (now_ms - r.start_ms - 1) / r.interval_ms + 1;
+                if (policy == MissedRunPolicy::RUN_ONCE) {
+                    --missed;  // leave the latest one, which runs right away
+                }
+                r.start_ms += missed * r.interval_ms;
+                schedule_log->advance(r.task_id, r.start_ms);
+            }
+            log("Recovered task ", r.task_id);
+            Task* t = task_pool.acquire();
+            *t = {r.task_id, fromMs(r.start_ms), ns::milliseconds{r.running_ms},
+                  std::move(fn), ns::milliseconds{r.slack_ms}};
+            taskq.append(t);
+            queued.insert(t->task_id, t);
+            if (r.interval_ms > 0) {
+                repeated_tasks.insert_or_assign(
+                    r.task_id, ns::milliseconds{r.interval_ms});
+            }
+        }
+        taskq.makeHeap();  // O(n) bulk load
+        if (!class_limits.empty()) {
+            class_depth[0] = taskq.size();  // persistent tasks are all class 0
+        }
+        if (auto it = oldest_by_class.find(0); it != oldest_by_class.end()) {
+            for (Task* t : taskq) {
+                if (isDroppable(t)) {
+                    it->second.push(t);
+                }
+            }
+        }
+        metrics.setQueueDepth(taskq.size());
+    }
+
+    static int64_t toMs(ns::system_clock::time_point t) {
+        return ns::duration_cast<ns::milliseconds>(t.time_since_epoch())
+            .count();
+    }
+    static ns::system_clock::time_point fromMs(int64_t ms) {
+        return ns::system_clock::time_point(ns::milliseconds{ms});
+    }
+
     void runEventLoop() {
+        event_loop_id.store(std::this_thread::get_id(),
+                            std::memory_order_relaxed);
         // for simplicity, suppose the task scheduler runs for a limited time
         auto last_time = start + MAX_DURATION;
         auto next_time{last_time};  // must initialize before declaring lambda
+        int num_checks = 0;  // the predicate runs once per wakeup, plus once
         auto new_earliest = [&]() {
-            // ignore the case of start_time > next_time, extra wakeup anyway
-            return (!taskq.empty()) && taskq.top().start_time < next_time;
+            ++num_checks;
+            // only tasks starting before next_time are visited, so this is
+            // cheap unless many tasks are due at once
+            return getWakeTime(next_time) < next_time;
         };
 
         // we can manually lock and unlock a unique_lock but not a scoped_lock
         std::unique_lock lck(q_mutex);
+        auto locked_at = ns::steady_clock::now();
 
-        event_loop_running = true;  // this is the first place we need to lock
+        if (metrics_interval > ns::milliseconds{0} && metrics_sink) {
+            // task_id 0 is never handed out to clients
+            Task* t = task_pool.acquire();
+            *t = {0, start + metrics_interval, ns::milliseconds{0},
+                  [this]() { metrics_sink(metrics.snapshot()); }};
+            pushTask(t);
+            repeated_tasks.insert_or_assign(0, metrics_interval);
+        }
         while (true) {
+            if (schedule_log && schedule_log->getIsSnapshotDue()) {
+                // rotate under the lock, write the snapshot without it
+                auto records = schedule_log->beginSnapshot();
+                metrics.lock_hold.record(ns::steady_clock::now() - locked_at);
+                lck.unlock();
+                schedule_log->writeSnapshot(records);
+                lck.lock();
+                locked_at = ns::steady_clock::now();
+            }
+
             // We have the lock here so the queue state is accurate
             // Always update the queue state after reacquiring a lock: a task
             // could have been run, added or deleted
-            std::cout << printTime() << "Updating queue state" << std::endl;
-            next_time = taskq.empty()
-                            ? last_time
-                            : std::min(last_time, taskq.top().start_time);
+            log("Updating queue state");
+            next_time = getWakeTime(last_time);
 
-            bool timeout = !q_cvar.wait_until(lck, next_time, new_earliest);
+            metrics.lock_hold.record(ns::steady_clock::now() - locked_at);
+            num_checks = 0;
+            bool timeout = !waitUntil(lck, next_time, new_earliest);
+            locked_at = ns::steady_clock::now();
+            // wait_until hides the wakeups after which the predicate was still
+            // false (a later task was added, a task was deleted, or the OS woke
+            // us up for no reason), so count them here
+            bool slept = num_checks > 1;
+            metrics.recordSpuriousWakeups(slept ? num_checks - 2 : 0);
 
             // There are 4 possible reasons why we stopped waiting:
             // 1) A new task was added (either single or repeated)
@@ -177,9 +808,16 @@ class TaskScheduler {
             // 4) We timed out because we exceeded the max duration
 
             if (timeout && next_time == last_time) {  // case 4
-                std::cout << printTime() << "Shutting down event loop"
-                          << std::endl;
+                log("Shutting down event loop");
                 event_loop_running = false;
+                for (auto& [task_id, r] : running) {
+                    requestStop(r);  // so that the pool drains promptly
+                }
+                space_cvar.notify_all();  // blocked producers give up
+                if (schedule_log) {
+                    // so that the next start does not need to replay the log
+                    schedule_log->writeSnapshot(schedule_log->beginSnapshot());
+                }
                 return;  // we waited until timeout to shut down the scheduler
             }
 
@@ -188,43 +826,267 @@ class TaskScheduler {
             // nothing else to check and just need to update the queue state
             // before going back to sleep
             if (taskq.empty()) {
+                if (slept) {
+                    metrics.recordWakeup(false);
+                }
                 continue;
             }
 
-            // The queue is not empty and we need to execute the earliest task
+            // The queue is not empty and we need to execute the earliest tasks
             // if necessary. If not just update the queue state before sleeping
-            Task t = taskq.top();
-
-            // Cases 1) and 3) might require us to execute a task:
-            // 1) its scheduled time is not too far away so we don't bother
+            // Cases 1) and 3) might require us to execute tasks:
+            // 1) their scheduled time is not too far away so we don't bother
             // waiting (this could be case 1 adding a task for very soon)
-            // 3) its scheduled time was reached as indicated by the timeout,
+            // 3) the earliest deadline was reached as indicated by the timeout,
+            // and every task that has started by now joins the same batch
+            auto now = ns::system_clock::now();
+            auto due_time = now + MIN_DURATION;
+            while (!taskq.empty() && taskq.front()->start_time < due_time) {
+                if (taskq.front()->has_token &&
+                    taskq.front()->start_time > now) {
+                    // not before its token; the loop wakes up for it, and
+                    // every task behind it starts no earlier
+                    break;
+                }
+                if (deferIfRateLimited(now)) {
+                    continue;
+                }
+                batch.push_back(popTask());
+                int task_id = batch.back()->task_id;
+                if (batch.back()->stop.stop_possible()) {
+                    running.insert_or_assign(
+                        task_id, RunningTask{batch.back()->stop, {}});
+                }
+                if (schedule_log && !isRepeated(task_id)) {
+                    schedule_log->appendRemove(task_id);  // at most once
+                }
+            }
+            for (Task* t : deferred) {
+                pushTask(t);  // not before we are done popping
+            }
+            deferred.clear();
+            if (slept) {
+                metrics.recordWakeup(!batch.empty());
+            }
+            if (batch.empty()) {
+                continue;
+            }
+            if (workers) {
+                // The worker puts a repeated task back once it is done, so
+                // two iterations of the same task never overlap
+                for (Task* t : batch) {
+                    log("Dispatching task ", t->task_id);
+                    Strand* strand = t->strand;
+                    // small enough for std::function's inline buffer
+                    auto job = [this, t]() {
+                        runTask(*t);
+                        TimedLock lck(q_mutex, metrics.lock_hold);
+                        if (finishTask(t)) {
+                            wakeLoop();
+                        }
+                    };
+                    if (strand) {
+                        strand->post(std::move(job));  // in order of the batch
+                    } else {
+                        workers->submit(std::move(job));
+                    }
+                }
+                batch.clear();
+                continue;
+            }
+            metrics.lock_hold.record(ns::steady_clock::now() - locked_at);
+            lck.unlock();
+            for (Task* t : batch) {
+                log("Running task ", t->task_id);
+                runTask(*t);  // run while unlocked
+            }
+            // Without manual locking we give up lck even if we did nothing
+            lck.lock();
+            locked_at = ns::steady_clock::now();
+            for (Task* t : batch) {
+                finishTask(t);
+            }
+            batch.clear();
+        }
+    }
 
-            if (timeout ||
-                t.start_time < ns::system_clock::now() + MIN_DURATION) {
-                taskq.pop();
-                executed_tasks.insert(t.task_id);  // in case the delete comes
-                lck.unlock();
-                std::cout << printTime() << "Running task " << t.task_id
-                          << std::endl;
-                t.run();  // run while unlocked
-                // Without manual locking we give up lck even if we did nothing
-                lck.lock();
-                if (repeated_tasks.find(t.task_id) != repeated_tasks.end()) {
-                    std::cout << printTime() << "Adding repeated task "
-                              << t.task_id << " back to the queue" << std::endl;
-                    taskq.emplace(t.task_id,
-                                  t.start_time + repeated_tasks.at(t.task_id),
-                                  t.running_time);
+    // Must hold q_mutex. Returns the earliest deadline (start_time + slack) of
+    // all tasks, or cap if that is earlier. In the heap a child never starts
+    // before its parent, so a subtree whose root starts at or after the best
+    // deadline so far cannot improve it and is skipped.
+    ns::system_clock::time_point getWakeTime(
+        ns::system_clock::time_point cap) const {
+        lowerWakeTime(0, cap);
+        return cap;
+    }
+
+    void lowerWakeTime(size_t idx, ns::system_clock::time_point& wake) const {
+        if (idx >= taskq.size() || taskq[idx]->start_time >= wake) {
+            return;
+        }
+        wake = std::min(wake, taskq[idx]->start_time + taskq[idx]->slack);
+        lowerWakeTime(2 * idx + 1, wake);
+        lowerWakeTime(2 * idx + 2, wake);
+    }
+
+    // Must hold q_mutex for all three
+    void pushTask(Task* t) {
+        if (!class_limits.empty()) {
+            ++class_depth[t->task_class];
+        }
+        taskq.push(t);
+        queued.insert(t->task_id, t);
+        if (!oldest_by_class.empty()) {
+            if (auto it = oldest_by_class.find(t->task_class);
+                it != oldest_by_class.end() && isDroppable(t)) {
+                it->second.push(t);
+            }
+        }
+        metrics.setQueueDepth(taskq.size());
+    }
+
+    Task* popTask() {
+        Task* t = taskq.pop();
+        onTaskLeft(t);
+        return t;
+    }
+
+    // Removes a task from anywhere in the heap and recycles its slot
+    void eraseTask(Task* t) {
+        taskq.erase(t);
+        onTaskLeft(t);
+        task_pool.recycle(t);  // a pending future learns it was cancelled
+    }
+
+    void onTaskLeft(Task* t) {
+        queued.erase(t->task_id);
+        if (!class_limits.empty()) {
+            --class_depth[t->task_class];
+        }
+        if (!oldest_by_class.empty()) {
+            if (auto it = oldest_by_class.find(t->task_class);
+                it != oldest_by_class.end() && it->second.contains(t)) {
+                it->second.erase(t);
+            }
+        }
+        metrics.setQueueDepth(taskq.size());
+        if (num_blocked > 0) {
+            space_cvar.notify_all();  // they re-check their own limit
+        }
+    }
+
+    // Runs the task without holding q_mutex and records how late and how long
+    void runTask(Task& t) {
+        auto run_start = ns::steady_clock::now();
+        metrics.lateness.record(ns::system_clock::now() - t.start_time);
+        t.run();
+        metrics.run_time.record(ns::steady_clock::now() - run_start);
+        metrics.recordTaskRun();
+        log("Finished task ", t.task_id);
+    }
+
+    // Must hold q_mutex. If the first task in the queue is rate-limited and
+    // its bucket is empty, reserves the next free token for it and moves it
+    // to deferred with its start_time set to when that token arrives. It
+    // then runs on that token, so it is deferred at most once per run.
+    bool deferIfRateLimited(ns::system_clock::time_point now) {
+        if (buckets.empty()) {
+            return false;
+        }
+        Task* t = taskq.front();
+        if (t->has_token) {
+            t->has_token = false;  // taken when it was deferred
+            return false;
+        }
+        auto it = buckets.find(t->task_class);
+        if (it == buckets.end() || it->second.tryTake(now)) {
+            return false;
+        }
+        deferred.push_back(popTask());
+        deferred.back()->start_time = it->second.reserve(now);
+        deferred.back()->has_token = true;
+        log("Deferring task ", deferred.back()->task_id, " (rate limit)");
+        metrics.recordDeferred();
+        return true;
+    }
+
+    // Must hold q_mutex. Called once a task has run; returns true iff it was
+    // put back in the queue (a cancelled task never is). Otherwise its slot
+    // is recycled.
+    bool finishTask(Task* t) {
+        bool cancelled = false;
+        if (t->stop.stop_possible()) {
+            auto it = running.find(t->task_id);
+            cancelled = t->stop.stop_requested();
+            if (it != running.end()) {
+                if (cancelled) {
+                    metrics.cancel_latency.record(ns::steady_clock::now() -
+                                                  it->second.requested_at);
+                    metrics.recordCancelled();
                 }
+                running.erase(it);
+            }
+        }
+        if (!cancelled && requeueIfRepeated(t)) {
+            return true;
+        }
+        task_pool.recycle(t);
+        return false;
+    }
+
+    struct RunningTask {
+        std::stop_source stop;
+        ns::steady_clock::time_point requested_at;  // if stop was requested
+    };
+
+    // Must hold q_mutex
+    void requestStop(RunningTask& r) {
+        if (!r.stop.stop_requested()) {
+            r.requested_at = ns::steady_clock::now();
+            r.stop.request_stop();
+        }
+    }
+
+    // Must hold q_mutex. Repeated by interval or by a recurrence rule.
+    bool isRepeated(int task_id) const {
+        return repeated_tasks.contains(task_id) ||
+               recurrence_rules.contains(task_id);
+    }
+
+    // Must hold q_mutex. Whether a queue limit may drop the task.
+    bool isDroppable(const Task* t) const {
+        return t->task_id != 0 && !isRepeated(t->task_id);
+    }
+
+    // Must hold q_mutex. Returns true iff the task was put back in the queue.
+    bool requeueIfRepeated(Task* t) {
+        if (auto rule = recurrence_rules.find(t->task_id);
+            rule != recurrence_rules.end()) {
+            // a late run skips the fire times it overran, no catch-up burst
+            t->start_time = rule->second->getNextFire(
+                std::max(t->start_time, ns::system_clock::now()));
+            if (t->start_time == ns::system_clock::time_point::max()) {
+                log("Recurring task ", t->task_id, " has no more fire times");
+                recurrence_rules.erase(rule);
+                return false;
             }
+        } else if (auto it = repeated_tasks.find(t->task_id);
+                   it != repeated_tasks.end()) {
+            t->start_time += it->second;
+        } else {
+            return false;
+        }
+        log("Adding repeated task ", t->task_id, " back to the queue");
+        if (schedule_log) {
+            schedule_log->advance(t->task_id, toMs(t->start_time));
         }
+        pushTask(t);
+        return true;
     }
 
     bool get_event_loop_running() {
         if (!event_loop_running) {
-            std::cout << printTime() << "ERROR: Event loop not running"
-                      << std::endl;
+            log("ERROR: Event loop not running");
         }
         return event_loop_running;
     }
@@ -234,16 +1096,59 @@ class TaskScheduler {
     // if the new task starts within MIN_DURATION from now, don't add to queue
     ns::milliseconds MIN_DURATION{20};
     // MAX_DURATION for which the task scheduler is allowed to run
-    ns::seconds MAX_DURATION{4};
+    ns::milliseconds MAX_DURATION;
+    bool verbose;
+    ns::milliseconds metrics_interval;
+    std::function<void(const MetricsSnapshot&)> metrics_sink;
+    std::unordered_map<int, std::function<void()>> handlers;
+    const QueueLimit queue_limit;
+    const std::unordered_map<int, QueueLimit> class_limits;
+    std::unique_ptr<ScheduleLog> schedule_log;  // null = not persistent
 
     int next_task_id{1};
-    std::unordered_set<int> executed_tasks;
+    // cancellable tasks that have been dispatched and have not finished yet
+    std::unordered_map<int, RunningTask> running;
     std::unordered_map<int, ns::milliseconds> repeated_tasks;
+    // tasks repeated by a rule instead (never in repeated_tasks)
+    std::unordered_map<int, std::shared_ptr<const RecurrenceRule>>
+        recurrence_rules;
 
-    std::thread event_loop_thread;
     bool event_loop_running = false;
+    // default-constructed (no thread) until the loop starts
+    std::atomic<std::thread::id> event_loop_id;
 
-    std::priority_queue<Task> taskq;  // defaults to vector
+    // every task that is queued, deferred or running has a slot here
+    SlabPool<Task> task_pool;
+    // a binary heap with the earliest start on top
+    IntrusiveHeap<Task> taskq;
+    IdIndex<Task> queued;  // the tasks in taskq, by task_id
+    std::vector<Task*> batch;  // tasks due in the current wakeup, reused
+    std::vector<Task*> deferred;  // due but rate-limited, reused
+    std::unordered_map<int, TokenBucket> buckets;
     std::mutex q_mutex;
     std::condition_variable q_cvar;
-};
\ No newline at end of file
+    // only tracked if there are class limits
+    std::unordered_map<int, size_t> class_depth;
+    // the droppable queued tasks of each class with a DROP_OLDEST limit, by
+    // start time like taskq
+    std::unordered_map<int, IntrusiveHeap<Task, &Task::class_heap_idx>>
+        oldest_by_class;
+    // producers waiting for room, see admit
+    std::condition_variable_any space_cvar;
+    int num_blocked{0};
+
+    SchedulerMetrics metrics;
+
+    // The event loop thread is only started at the end of the constructor, once
+    // every member (and the recovered queue) is in place. Members are destroyed
+    // in reverse order, so the pool is drained before the queue goes away (its
+    // jobs might still access it).
+    std::unique_ptr<EpollReactor> reactor;  // null = sleep on q_cvar
+    std::unique_ptr<WorkerPool> workers;
+    // Without workers every task already runs serially on the event loop
+    // thread, so a task's strand is simply ignored there
+    StrandMap<std::string> strands;
+    std::thread event_loop_thread;
+};
+
+#endif  // TASK_SCHEDULER_H_
\ No newline at end of file
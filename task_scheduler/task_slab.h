@@ -0,0 +1,260 @@
+/*
+    Storage for the scheduler's tasks that does not go back to malloc once the
+   scheduler has warmed up.
+
+   1) SlabPool hands out objects from chunks of chunk_size slots, in the
+   spirit of resource_pool.h: a slot that is done with is recycled instead of
+   freed, and the next acquire reuses it. Unlike ResourcePool it is not shared
+   between threads or handed to clients (the scheduler owns every slot and
+   only touches the pool under q_mutex), so it needs no smart pointers, weak
+   references or locking. Chunks never move, so a slot's address is stable
+   for as long as the pool lives; a new chunk is only allocated when every
+   slot is in use.
+
+   2) IntrusiveHeap is the binary heap that std::push_heap etc. maintain, but
+   over pointers to slots, each of which stores its own position in the heap
+   (heap_idx). Sifting moves 8-byte pointers instead of whole tasks, and a
+   task can be taken out of the middle in O(log n) rather than by rebuilding
+   the heap. Like with std::push_heap, a < b means that b comes out first.
+   The position member is a template parameter, so a slot with two of them
+   can be in two heaps at once.
+
+   3) IdIndex finds a slot by its id in O(1) on average, so that a task can
+   be deleted by task_id without scanning the heap. It is an open-addressing
+   table (linear probing, with entries shifted back on erase instead of
+   tombstones) that only grows, so like the pool it stops allocating once it
+   has reached the peak number of ids.
+
+   Recycling a slot resets the object to T{}, which releases whatever it
+   holds (e.g. a callable and what it captured) right away rather than when
+   the slot is next used.
+*/
+
+#ifndef TASK_SLAB_H_
+#define TASK_SLAB_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+template <typename T>
+class SlabPool {
+   public:
+    explicit SlabPool(size_t chunk_size = 256) : chunk_size(chunk_size) {}
+    SlabPool(const SlabPool& other) = delete;
+    SlabPool& operator=(const SlabPool& other) = delete;
+
+    // A slot in its default state
+    T* acquire() {
+        if (free_slots.empty()) {
+            grow();
+        }
+        T* slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    void recycle(T* slot) {
+        *slot = T{};
+        free_slots.push_back(slot);  // never reallocates, see grow
+    }
+
+    size_t getNumChunks() const { return chunks.size(); }
+    size_t getCapacity() const { return chunks.size() * chunk_size; }
+
+   private:
+    void grow() {
+        auto& chunk = chunks.emplace_back(std::make_unique<T[]>(chunk_size));
+        free_slots.reserve(getCapacity());  // room for every slot at once
+        for (size_t i = chunk_size; i-- > 0;) {
+            free_slots.push_back(&chunk[i]);  // hand out in address order
+        }
+    }
+
+    size_t chunk_size;
+    std::vector<std::unique_ptr<T[]>> chunks;
+    std::vector<T*> free_slots;
+};
+
+// T must have an operator< and a size_t member (Idx) for its position
+template <typename T, size_t T::*Idx = &T::heap_idx>
+class IntrusiveHeap {
+   public:
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    T* front() const { return heap.front(); }
+    T* operator[](size_t idx) const { return heap[idx]; }
+    auto begin() const { return heap.begin(); }
+    auto end() const { return heap.end(); }
+    bool contains(const T* t) const {
+        return t->*Idx < heap.size() && heap[t->*Idx] == t;
+    }
+
+    void push(T* t) {
+        t->*Idx = heap.size();
+        heap.push_back(t);
+        siftUp(t->*Idx);
+    }
+
+    T* pop() {
+        T* top = heap.front();
+        erase(top);
+        return top;
+    }
+
+    // t must be in the heap
+    void erase(T* t) {
+        size_t idx = t->*Idx;
+        T* last = heap.back();
+        heap.pop_back();
+        if (last == t) {
+            return;
+        }
+        place(last, idx);
+        if (idx > 0 && *heap[(idx - 1) / 2] < *last) {
+            siftUp(idx);
+        } else {
+            siftDown(idx);
+        }
+    }
+
+    // Adds t without restoring the heap property; call makeHeap after a
+    // batch of appends for an O(n) bulk load
+    void append(T* t) { heap.push_back(t); }
+
+    void makeHeap() {
+        std::make_heap(heap.begin(), heap.end(),
+                       [](const T* a, const T* b) { return *a < *b; });
+        for (size_t i = 0; i < heap.size(); ++i) {
+            heap[i]->*Idx = i;
+        }
+    }
+
+   private:
+    void place(T* t, size_t idx) {
+        heap[idx] = t;
+        t->*Idx = idx;
+    }
+
+    void siftUp(size_t idx) {
+        T* t = heap[idx];
+        while (idx > 0) {
+            size_t parent = (idx - 1) / 2;
+            if (!(*heap[parent] < *t)) {
+                break;
+            }
+            place(heap[parent], idx);
+            idx = parent;
+        }
+        place(t, idx);
+    }
+
+    void siftDown(size_t idx) {
+        T* t = heap[idx];
+        while (true) {
+            size_t child = 2 * idx + 1;
+            if (child >= heap.size()) {
+                break;
+            }
+            if (child + 1 < heap.size() && *heap[child] < *heap[child + 1]) {
+                ++child;
+            }
+            if (!(*t < *heap[child])) {
+                break;
+            }
+            place(heap[child], idx);
+            idx = child;
+        }
+        place(t, idx);
+    }
+
+    std::vector<T*> heap;
+};
+
+template <typename T>
+class IdIndex {
+   public:
+    // nullptr if id is not in the index
+    T* find(int id) const {
+        if (entries.empty()) {
+            return nullptr;
+        }
+        for (size_t i = getHome(id);; i = (i + 1) & mask) {
+            if (!entries[i].slot || entries[i].id == id) {
+                return entries[i].slot;
+            }
+        }
+    }
+
+    // id must not be in the index yet
+    void insert(int id, T* slot) {
+        if (2 * (num_entries + 1) > entries.size()) {
+            grow();  // at most half full, so probe runs stay short
+        }
+        size_t i = getHome(id);
+        while (entries[i].slot) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = {id, slot};
+        ++num_entries;
+    }
+
+    void erase(int id) {
+        if (entries.empty()) {
+            return;
+        }
+        size_t i = getHome(id);
+        while (entries[i].slot && entries[i].id != id) {
+            i = (i + 1) & mask;
+        }
+        if (!entries[i].slot) {
+            return;
+        }
+        // Move back every later entry of the run that may live at i, i.e.
+        // whose home is not in (i, j], so that lookups never stop early
+        for (size_t j = (i + 1) & mask; entries[j].slot; j = (j + 1) & mask) {
+            size_t home = getHome(entries[j].id);
+            bool stays = i <= j ? i < home && home <= j : i < home || home <= j;
+            if (!stays) {
+                entries[i] = entries[j];
+                i = j;
+            }
+        }
+        entries[i] = {};
+        --num_entries;
+    }
+
+    size_t size() const { return num_entries; }
+
+   private:
+    struct Entry {
+        int id{0};
+        T* slot{nullptr};  // nullptr = empty
+    };
+
+    // Fibonacci hashing: ids are sequential, this spreads them out
+    size_t getHome(int id) const {
+        return (uint64_t{static_cast<uint32_t>(id)} * 0x9e3779b97f4a7c15 >>
+                32) &
+               mask;
+    }
+
+    void grow() {
+        std::vector<Entry> old(std::max<size_t>(16, 2 * entries.size()));
+        old.swap(entries);
+        mask = entries.size() - 1;
+        num_entries = 0;
+        for (const Entry& e : old) {
+            if (e.slot) {
+                insert(e.id, e.slot);
+            }
+        }
+    }
+
+    std::vector<Entry> entries;  // a power of two in size
+    size_t mask{0};
+    size_t num_entries{0};
+};
+
+#endif  // TASK_SLAB_H_
@@ -3,10 +3,21 @@ Compile with
 g20 -pthread task_scheduler.h test_task_scheduler.cpp -o ../bin/task_scheduler
 */
 
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_set>
+
+#include "sharded_scheduler.h"
 #include "task_scheduler.h"
 using namespace std::chrono_literals;
 
-int main() {
+void testSingleAndRepeated() {
     auto start = ns::system_clock::now();
     TaskScheduler TS(start);
     std::this_thread::sleep_until(start + 100ms);
@@ -51,4 +62,668 @@ int main() {
     std::cout << std::endl;
     std::cout << "Tasks deleted successfully?\n"
               << ok1 << " " << ok2 << " " << ok3 << " " << ok4 << std::endl;
+}
+
+void testTaskGraph() {
+    // snapshot -> {analytics 1, analytics 2} -> publish, where the analytics
+    // nodes should run in parallel on the pool
+    std::atomic<int> step{0};
+    int snapshot_step = -1, publish_step = -1;
+    std::atomic<int> analytics_steps{0};
+    std::atomic<bool> completed{false};
+
+    auto graph = std::make_shared<TaskGraph>();
+    auto snapshot = graph->addNode([&]() { snapshot_step = step++; });
+    auto analytics1 = graph->addNode([&]() {
+        std::this_thread::sleep_for(100ms);
+        analytics_steps += step++;
+    });
+    auto analytics2 = graph->addNode([&]() {
+        std::this_thread::sleep_for(100ms);
+        analytics_steps += step++;
+    });
+    auto publish = graph->addNode([&]() { publish_step = step++; });
+    graph->addEdge(snapshot, analytics1);
+    graph->addEdge(snapshot, analytics2);
+    graph->addEdge(analytics1, publish);
+    graph->addEdge(analytics2, publish);
+
+    auto cyclic = std::make_shared<TaskGraph>();
+    auto a = cyclic->addNode({});
+    auto b = cyclic->addNode({});
+    cyclic->addEdge(a, b);
+    cyclic->addEdge(b, a);
+
+    auto start = ns::system_clock::now();
+    {
+        TaskScheduler TS(start, {.max_duration = 600ms, .num_workers = 2});
+        std::this_thread::sleep_until(start + 50ms);
+        int g1 = TS.scheduleGraph(start + 100ms, graph,
+                                  [&]() { completed = true; });
+        int g2 = TS.scheduleGraph(start + 100ms, cyclic);
+        assert(g1 > 0 && g2 == -1);
+        // two sleeping nodes in parallel take ~100ms, not ~200ms
+        std::this_thread::sleep_until(start + 280ms);
+        assert(completed);
+    }
+    assert(snapshot_step == 0 && analytics_steps == 1 + 2 &&
+           publish_step == 3);
+    std::cout << "Task graph ran in dependency order" << std::endl;
+}
+
+void testFutures() {
+    auto start = ns::system_clock::now();
+    std::atomic<int> continuation_result{0};
+    {
+        TaskScheduler TS(start, {.max_duration = 500ms, .num_workers = 1});
+        std::this_thread::sleep_until(start + 50ms);
+        auto f1 = TS.scheduleTask(start + 100ms, []() { return 6 * 7; });
+        auto f2 = TS.scheduleTask(start + 100ms, []() -> int {
+            throw std::runtime_error("task failed");
+        });
+        auto f3 = TS.scheduleTask(start + 300ms, []() {});
+        int t4 = TS.scheduleTask(
+            start + 100ms, []() { return 5; },
+            [&](int r) { continuation_result = r; });
+        bool deleted = TS.deleteScheduled(f3.task_id());
+        assert(f1.task_id() > 0 && t4 > 0 && !f1.ready() && deleted);
+
+        int answer = f1.get();
+        assert(answer == 42);
+        bool threw = false;
+        try {
+            f2.get();
+        } catch (const std::runtime_error& e) {
+            threw = true;
+        }
+        assert(threw);
+        threw = false;
+        try {
+            f3.get();  // deleted, so the promise is broken
+        } catch (const std::runtime_error& e) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    assert(continuation_result == 5);
+    std::cout << "Futures and continuations delivered results" << std::endl;
+}
+
+void testMetrics() {
+    auto start = ns::system_clock::now();
+    std::atomic<int> num_exports{0};
+    MetricsSnapshot last;
+    {
+        TaskScheduler TS(start, {.max_duration = 500ms,
+                                 .verbose = false,
+                                 .metrics_interval = 100ms,
+                                 .metrics_sink = [&](const MetricsSnapshot& m) {
+                                     last = m;
+                                     ++num_exports;
+                                 }});
+        std::this_thread::sleep_until(start + 50ms);
+        for (int i = 0; i < 10; ++i) {
+            TS.scheduleTask(start + 100ms + i * 20ms, 5ms);
+        }
+        int t = TS.scheduleTask(start + 450ms, 5ms);
+        TS.deleteScheduled(t);  // a wakeup that runs nothing
+
+        std::this_thread::sleep_until(start + 400ms);
+        // read from this thread while the event loop is running
+        auto m = TS.getMetricsSnapshot();
+        std::cout << m << std::endl;
+        assert(m.run_time.count == m.tasks_run);
+        assert(m.tasks_run >= 10);  // 10 tasks plus the exports so far
+        assert(m.max_queue_depth >= 10);
+        assert(m.wakeups == m.useful_wakeups + m.spurious_wakeups);
+        assert(m.spurious_wakeups >= 1);
+        assert(m.lock_hold.count > 0);
+    }
+    assert(num_exports == 4);  // at 100, 200, 300 and 400ms
+    assert(last.lateness.count >= 10);
+    std::cout << "Metrics recorded and exported" << std::endl;
+}
+
+void testSlack() {
+    // Without slack these would need two wakeups (100ms and 130ms). With 50ms
+    // of slack each, we wake once at 150ms and run both.
+    auto start = ns::system_clock::now();
+    MetricsSnapshot m;
+    {
+        TaskScheduler TS(start, {.max_duration = 300ms, .verbose = false});
+        std::this_thread::sleep_until(start + 50ms);
+        TS.scheduleTask(start + 100ms, 0ms, 50ms);
+        TS.scheduleTask(start + 130ms, 0ms, 50ms);
+        std::this_thread::sleep_until(start + 250ms);
+        m = TS.getMetricsSnapshot();
+    }
+    assert(m.tasks_run == 2 && m.useful_wakeups == 1);
+    assert(m.lateness.max_ns >= 40'000'000);  // the first task ran ~50ms late
+    std::cout << "Tasks with overlapping slack shared a wakeup" << std::endl;
+}
+
+void testPersistence() {
+    const std::string path = "/tmp/test_task_scheduler";
+    for (auto suffix : {".log", ".log.old", ".snap"}) {
+        std::remove((path + suffix).c_str());
+    }
+    std::atomic<int> num_heartbeats{0};
+    std::unordered_map<int, std::function<void()>> handlers{
+        {7, [&]() { ++num_heartbeats; }}};
+
+    auto start = ns::system_clock::now();
+    int heartbeat = -1, deleted = -1, later = -1;
+    {
+        TaskScheduler TS(start, {.max_duration = 300ms,
+                                 .verbose = false,
+                                 .log_path = path,
+                                 .snapshot_every = 2,
+                                 .handlers = handlers});
+        std::this_thread::sleep_until(start + 50ms);
+        heartbeat = TS.scheduleHandler(7, start + 100ms, 100ms);
+        deleted = TS.scheduleRepeated(start + 100ms, 100ms, 0ms);
+        later = TS.scheduleTask(start + 2000ms, 0ms);
+        int done = TS.scheduleTask(start + 60ms, 0ms);  // runs before the end
+        TS.deleteScheduled(deleted);
+        assert(heartbeat > 0 && done > later);
+    }
+    assert(num_heartbeats == 2);  // at 100 and 200ms
+
+    // "restart" 500ms later: the heartbeat missed runs at 300, 400 and 500ms
+    std::this_thread::sleep_until(start + 550ms);
+    start = ns::system_clock::now();
+    {
+        TaskScheduler TS(start,
+                         {.max_duration = 100ms,
+                          .verbose = false,
+                          .log_path = path,
+                          .missed_run_policy = MissedRunPolicy::RUN_ONCE,
+                          .handlers = handlers});
+        // only the heartbeat and the later task were recovered
+        assert(TS.getMetricsSnapshot().max_queue_depth == 2);
+        // ids keep increasing across restarts
+        int next = TS.scheduleTask(start + 50ms, 0ms);
+        assert(next > later + 1);
+        bool ok1 = TS.deleteScheduled(deleted);
+        bool ok2 = TS.deleteScheduled(later);
+        assert(!ok1 && ok2);
+    }
+    // one catch-up run, then back on the 100ms grid
+    assert(num_heartbeats == 3 || num_heartbeats == 4);
+    std::cout << "Persistent tasks were recovered after a restart"
+              << std::endl;
+}
+
+void testStrands() {
+    // Two keys with many tasks due at once: each key's tasks must run one at a
+    // time and in the order they were scheduled, on any of the 4 workers
+    constexpr int N = 200;
+    std::vector<int> order[2];
+    std::atomic<bool> busy[2] = {false, false};
+    std::atomic<int> overlaps{0};
+    auto start = ns::system_clock::now();
+    {
+        TaskScheduler TS(start, {.max_duration = 300ms,
+                                 .num_workers = 4,
+                                 .verbose = false});
+        for (int i = 0; i < N; ++i) {
+            int k = i % 2;
+            auto key = k == 0 ? "AAPL" : "MSFT";
+            TS.scheduleOnStrand(key, start + 100ms, [&, k, i]() {
+                if (busy[k].exchange(true)) {
+                    ++overlaps;
+                }
+                order[k].push_back(i);
+                busy[k] = false;
+            });
+        }
+    }
+    assert(overlaps == 0);
+    for (int k = 0; k < 2; ++k) {
+        assert(order[k].size() == N / 2);
+        assert(std::is_sorted(order[k].begin(), order[k].end()));
+    }
+    std::cout << "Tasks on the same strand ran serially and in order"
+              << std::endl;
+}
+
+// Naive recursion, so that the spawned jobs nest several levels deep
+int fib(int n) {
+    if (n < 2) {
+        return n;
+    }
+    int a = 0, b = 0;
+    TaskGroup g;
+    g.spawn([&]() { a = fib(n - 1); });
+    b = fib(n - 2);
+    g.sync();
+    return a + b;
+}
+
+void testForkJoin() {
+    auto start = ns::system_clock::now();
+    TaskFuture<long> sum;
+    TaskFuture<int> f;
+    std::vector<long> v(100000);
+    {
+        TaskScheduler TS(start, {.max_duration = 200ms,
+                                 .num_workers = 4,
+                                 .verbose = false});
+        sum = TS.scheduleTask(start + 50ms, [&]() {
+            parallelFor(0, v.size(), [&](size_t i) { v[i] = i; }, 1000);
+            return std::accumulate(v.begin(), v.end(), 0L);
+        });
+        f = TS.scheduleTask(start + 50ms, []() { return fib(20); });
+    }
+    long total = sum.get();
+    int fib20 = f.get();
+    assert(total == 100000L * 99999 / 2 && fib20 == 6765);
+    assert(fib(10) == 55);  // not on a worker: runs serially
+    std::cout << "Fork-join tasks fanned out over the pool" << std::endl;
+}
+
+void testEpoll() {
+    // Timers and fd callbacks on the same thread: the pipe is read by the
+    // event loop itself, which then schedules a task for right away
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    std::atomic<int> num_bytes{0}, num_echoes{0};
+    std::thread::id callback_thread, task_thread;
+    auto start = ns::system_clock::now();
+    MetricsSnapshot m;
+    {
+        TaskScheduler TS(start, {.max_duration = 300ms,
+                                 .verbose = false,
+                                 .use_epoll = true});
+        bool watched = TS.watchFd(fds[0], EPOLLIN, [&](uint32_t) {
+            char buf[16];
+            num_bytes += read(fds[0], buf, sizeof(buf));
+            callback_thread = std::this_thread::get_id();
+            TS.scheduleTask(ns::system_clock::now(), [&]() {
+                task_thread = std::this_thread::get_id();
+                ++num_echoes;
+            });
+        });
+        bool twice = TS.watchFd(fds[0], EPOLLIN, [](uint32_t) {});
+        assert(watched && !twice);
+        TS.scheduleTask(start + 100ms, 0ms);
+        for (int i = 0; i < 3; ++i) {
+            std::this_thread::sleep_until(start + 50ms * (i + 1) + 20ms);
+            ssize_t n = write(fds[1], "x", 1);
+            assert(n == 1);
+        }
+        std::this_thread::sleep_until(start + 250ms);
+        bool unwatched = TS.unwatchFd(fds[0]);
+        twice = TS.unwatchFd(fds[0]);
+        assert(unwatched && !twice);
+        m = TS.getMetricsSnapshot();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    assert(num_bytes == 3 && num_echoes == 3);
+    assert(callback_thread == task_thread);
+    assert(m.tasks_run == 4);
+    assert(m.lateness.max_ns < 20'000'000);
+    std::cout << "Fd callbacks and timers shared the epoll loop" << std::endl;
+}
+
+void testAdmissionControl() {
+    auto start = ns::system_clock::now();
+    std::vector<int> ran;
+    MetricsSnapshot m;
+    {
+        // at most 3 queued market data tasks (class 1), which replace the
+        // oldest, and at most 5 tasks in total, beyond which we block
+        TaskScheduler TS(
+            start,
+            {.max_duration = 300ms,
+             .verbose = false,
+             .queue_limit = {.max_queued = 5,
+                             .overflow = OverflowPolicy::BLOCK,
+                             .block_timeout = 20ms},
+             .class_limits = {{1, {.max_queued = 3,
+                                   .overflow = OverflowPolicy::DROP_OLDEST}}}});
+        for (int i = 0; i < 5; ++i) {
+            int id = TS.scheduleInClass(1, start + 100ms + 1ms * i,
+                                        [&ran, i]() { ran.push_back(i); });
+            assert(id > 0);
+        }
+        // 0 and 1 were dropped. Class 0 fills up the queue, then times out.
+        int id1 = TS.scheduleTask(start + 200ms, 0ms);
+        int id2 = TS.scheduleTask(start + 200ms, 0ms);
+        assert(id1 > 0 && id2 > 0);
+        auto blocked_at = ns::steady_clock::now();
+        int timed_out = TS.scheduleTask(start + 200ms, 0ms);
+        assert(timed_out == -1);
+        assert(ns::steady_clock::now() - blocked_at >= 20ms);
+        int rejected = TS.scheduleInClass(2, start + 100ms, []() {});
+        assert(rejected == -1);
+        // a blocked producer gets in once the class 1 tasks have run
+        std::this_thread::sleep_until(start + 90ms);
+        std::thread producer([&]() {
+            int id = TS.scheduleTask(start + 200ms, 0ms);
+            assert(id > 0);
+        });
+        producer.join();
+        m = TS.getMetricsSnapshot();
+    }
+    assert((ran == std::vector<int>{2, 3, 4}));
+    assert(m.tasks_dropped == 2 && m.tasks_rejected == 2);
+    assert(m.producers_blocked == 3 && m.max_queue_depth == 5);
+
+    // a repeated task is never the one dropped, even when it is due first,
+    // whether by a class limit or by the limit on the whole queue
+    for (bool by_class : {true, false}) {
+        start = ns::system_clock::now();
+        QueueLimit two{.max_queued = 2,
+                       .overflow = OverflowPolicy::DROP_OLDEST};
+        ran.clear();
+        {
+            SchedulerOptions opts{.max_duration = 150ms, .verbose = false};
+            if (by_class) {
+                opts.class_limits = {{0, two}};
+            } else {
+                opts.queue_limit = two;
+            }
+            TaskScheduler TS(start, opts);
+            int repeated = TS.scheduleRepeated(start + 50ms, 1s, 0ms);
+            int first = TS.scheduleInClass(0, start + 60ms,
+                                           [&ran]() { ran.push_back(1); });
+            int second = TS.scheduleInClass(0, start + 70ms,
+                                            [&ran]() { ran.push_back(2); });
+            assert(repeated > 0 && first > 0 && second > 0);
+            std::this_thread::sleep_until(start + 120ms);
+            m = TS.getMetricsSnapshot();
+        }
+        assert((ran == std::vector<int>{2}));
+        assert(m.tasks_dropped == 1 && m.tasks_run == 2);
+    }
+
+    // a class limit of 0 only sets the policy, it does not bound the class
+    start = ns::system_clock::now();
+    {
+        TaskScheduler TS(start, {.max_duration = 100ms,
+                                 .verbose = false,
+                                 .class_limits = {{1, {.max_queued = 0}}}});
+        for (int i = 0; i < 3; ++i) {
+            int id = TS.scheduleInClass(1, start + 50ms, []() {});
+            assert(id > 0);
+        }
+    }
+    std::cout << "Queue limits shed and blocked as configured" << std::endl;
+}
+
+void testSharded() {
+    auto start = ns::system_clock::now();
+    std::mutex m;
+    std::unordered_map<std::string, std::unordered_set<std::thread::id>>
+        threads;
+    {
+        ShardedScheduler SS(start, 4, {.max_duration = 200ms, .verbose = false},
+                            false);
+        assert(SS.size() == 4 && SS.getLocalShard() < 4);
+        for (int i = 0; i < 20; ++i) {
+            std::string key = i % 2 ? "AAPL" : "MSFT";
+            auto h = SS.scheduleOnKey(key, start + 50ms, [&, key]() {
+                std::scoped_lock lck(m);
+                threads[key].insert(std::this_thread::get_id());
+            });
+            assert(ShardedScheduler::getShardOf(h) == SS.getShardForKey(key));
+        }
+        // pinned, so that the CPU cannot change between the two calls
+        cpu_set_t before, here;
+        pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+        int cpu = sched_getcpu();
+        CPU_ZERO(&here);
+        CPU_SET(std::max(cpu, 0), &here);
+        bool pinned = cpu >= 0 && pthread_setaffinity_np(pthread_self(),
+                                                         sizeof(here),
+                                                         &here) == 0;
+        auto h = SS.scheduleTask(start + 100ms, 0ms);
+        assert(!pinned ||
+               ShardedScheduler::getShardOf(h) == SS.getLocalShard());
+        pthread_setaffinity_np(pthread_self(), sizeof(before), &before);
+        bool deleted = SS.deleteScheduled(h);
+        bool twice = SS.deleteScheduled(h);
+        assert(deleted && !twice);
+        std::this_thread::sleep_until(start + 150ms);
+        assert(SS.getTasksRun() == 20);
+    }
+    // each key ran on its own shard's single loop thread
+    assert(threads["AAPL"].size() == 1 && threads["MSFT"].size() == 1);
+
+    // one shard per CPU in the affinity mask (which need not start at 0),
+    // and a thread on that CPU schedules into its shard
+    {
+        ShardedScheduler SS(start, 0, {.max_duration = 50ms, .verbose = false});
+        cpu_set_t allowed, here;
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        assert(SS.size() == std::min<size_t>(CPU_COUNT(&allowed),
+                                             ShardedScheduler::MAX_SHARDS));
+        for (size_t i = 0; i < SS.size(); ++i) {
+            int cpu = SS.getShardCpu(i);
+            assert(cpu >= 0 && CPU_ISSET(cpu, &allowed));
+            CPU_ZERO(&here);
+            CPU_SET(cpu, &here);
+            bool pinned = pthread_setaffinity_np(pthread_self(), sizeof(here),
+                                                 &here) == 0;
+            assert(!pinned || SS.getLocalShard() == i);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+    }
+    std::cout << "Sharded scheduler routed tasks by key and CPU" << std::endl;
+}
+
+void testCancellation() {
+    // A long task on a worker is interrupted by deleteScheduled, a repeated
+    // one by the shutdown. Neither holds up the pool for its full duration.
+    auto long_task = [](std::stop_token token) {
+        for (int i = 0; i < 1000 && !token.stop_requested(); ++i) {
+            std::this_thread::sleep_for(1ms);
+        }
+    };
+    auto start = ns::system_clock::now();
+    MetricsSnapshot m;
+    int single = -1;
+    {
+        TaskScheduler TS(start, {.max_duration = 200ms,
+                                 .num_workers = 2,
+                                 .verbose = false});
+        single = TS.scheduleCancellable(start + 50ms, long_task);
+        TS.scheduleCancellable(start + 50ms, long_task, 100ms);
+        std::this_thread::sleep_until(start + 100ms);
+        bool deleted = TS.deleteScheduled(single);  // running: stop requested
+        assert(deleted);
+        std::this_thread::sleep_until(start + 150ms);
+        deleted = TS.deleteScheduled(single);
+        assert(!deleted);
+        m = TS.getMetricsSnapshot();
+    }
+    // the repeated task would otherwise hold up the shutdown until ~1050ms
+    assert(ns::system_clock::now() - start < 400ms);
+    assert(m.tasks_cancelled == 1 && m.cancel_latency.count == 1);
+    assert(m.cancel_latency.max_ns < 10'000'000);
+    std::cout << "Running tasks stopped on deletion and shutdown" << std::endl;
+}
+
+void testRecurrenceRules() {
+    using namespace std::chrono;
+    auto cal = std::make_shared<TradingCalendar>(
+        2026y / 1 / 1, 2026y / 12 / 31,
+        std::vector<year_month_day>{2026y / 12 / 25});
+    // every 5 minutes from 14:00 to 20:55 UTC on weekdays
+    auto rule = RecurrenceRule::fromCron("*/5 14-20 * * 1-5", cal);
+    auto dec24 = sys_days(2026y / 12 / 24);
+    assert(rule->getNextFire(dec24 + 14h + 5min) == dec24 + 14h + 10min);
+    // Christmas is a holiday, then comes a weekend
+    assert(rule->getNextFire(dec24 + 20h + 56min) ==
+           sys_days(2026y / 12 / 28) + 14h);
+    // every 30 minutes from 9:30 to 16:00 in New York (UTC-5)
+    auto session = RecurrenceRule::everyDuringSessions(
+        30min, {{9h + 30min, 16h}}, cal, -5h);
+    assert(session->getNextFire(dec24 + 14h) == dec24 + 14h + 30min);
+    assert(session->getNextFire(sys_days(2026y / 12 / 31) + 21h) ==
+           system_clock::time_point::max());  // past the calendar
+    // both day fields restricted: the 1st of the month or a Monday
+    auto noon = RecurrenceRule::fromCron("0 12 1 * 1", cal);
+    auto nov30 = sys_days(2026y / 11 / 30);  // a Monday, Dec 1 is a Tuesday
+    auto dec1 = sys_days(2026y / 12 / 1);
+    assert(noon->getNextFire(nov30 + 13h) == dec1 + 12h);
+    assert(noon->getNextFire(dec1 + 12h) == nov30 + days{7} + 12h);
+    assert(!RecurrenceRule::fromCron("61 * * * *"));
+    assert(!RecurrenceRule::fromCron("* * *"));
+    // every list item must be a number, range or step in full
+    for (const char* bad : {"5x * * * *", "1-5abc * * * *",
+                            "*/15junk * * * *", "1,2, * * * *",
+                            ",1 * * * *", "1,,2 * * * *", "- * * * *",
+                            "*/ * * * *"}) {
+        assert(!RecurrenceRule::fromCron(bad));
+    }
+    assert(RecurrenceRule::fromCron("0,30 9-16/2 * * 1-5"));
+
+    // Outside its window, a rule costs one sleeping task and no wakeups
+    auto start = ns::system_clock::now();
+    MetricsSnapshot m;
+    {
+        TaskScheduler TS(start, {.max_duration = 100ms, .verbose = false});
+        auto past = std::make_shared<TradingCalendar>(2000y / 1 / 1,
+                                                      2000y / 12 / 31);
+        int never = TS.scheduleRecurring(
+            RecurrenceRule::fromCron("* * * * *", past), []() {});
+        int invalid =
+            TS.scheduleRecurring(RecurrenceRule::fromCron("* *"), []() {});
+        assert(never == -1 && invalid == -1);
+        int id = TS.scheduleRecurring(RecurrenceRule::fromCron("0 0 1 1 *"),
+                                      []() {});
+        assert(id > 0);
+        std::this_thread::sleep_until(start + 50ms);
+        m = TS.getMetricsSnapshot();
+        bool deleted = TS.deleteScheduled(id);
+        assert(deleted);
+    }
+    assert(m.queue_depth == 1 && m.wakeups == 0);
+    std::cout << "Recurrence rules computed their next fire times"
+              << std::endl;
+}
+
+void testRateLimit() {
+    // 10 orders due at once, at most 100/s with a burst of 2: the first two
+    // go right away, then one every 10ms, without any task sleeping
+    auto start = ns::system_clock::now();
+    std::vector<ns::system_clock::time_point> sent;
+    MetricsSnapshot m;
+    {
+        TaskScheduler TS(start, {.max_duration = 300ms,
+                                 .verbose = false,
+                                 .class_rates = {{3, {100, 2}}}});
+        for (int i = 0; i < 10; ++i) {
+            TS.scheduleInClass(3, start + 50ms, [&]() {
+                sent.push_back(ns::system_clock::now());
+            });
+        }
+        std::this_thread::sleep_until(start + 250ms);
+        m = TS.getMetricsSnapshot();
+    }
+    assert(sent.size() == 10 && m.tasks_deferred == 8);  // once each
+    for (size_t i = 2; i < sent.size(); ++i) {
+        assert(sent[i] - sent[i - 1] >= 9ms);  // one token per 10ms
+    }
+    assert(sent.back() - sent.front() < 120ms);
+
+    // a limit that would never let a task run is refused up front
+    for (RateLimit bad :
+         {RateLimit{0, 1}, RateLimit{-5, 2}, RateLimit{10, 0.5}}) {
+        bool refused = false;
+        try {
+            TaskScheduler TS(start, {.max_duration = 0ms,
+                                     .verbose = false,
+                                     .class_rates = {{3, bad}}});
+        } catch (const std::invalid_argument&) {
+            refused = true;
+        }
+        assert(refused);
+    }
+    std::cout << "Rate-limited tasks were deferred to their tokens"
+              << std::endl;
+}
+
+void testTaskSlab() {
+    // tasks come out of the heap in start order (ties by id), also after
+    // some were erased from the middle, and their slots are reused
+    SlabPool<Task> pool(4);
+    IntrusiveHeap<Task> heap;
+    auto t0 = ns::system_clock::now();
+    std::vector<Task*> tasks;
+    for (int i = 0; i < 20; ++i) {
+        Task* t = pool.acquire();
+        t->task_id = i;
+        t->start_time = t0 + ns::milliseconds{(i * 7) % 5};
+        heap.push(t);
+        tasks.push_back(t);
+    }
+    // a second heap over some of them keeps its own positions
+    IntrusiveHeap<Task, &Task::class_heap_idx> evens;
+    for (int i = 0; i < 20; i += 2) {
+        evens.push(tasks[i]);
+    }
+    for (int i : {3, 0, 17, 11}) {
+        heap.erase(tasks[i]);
+        if (evens.contains(tasks[i])) {
+            evens.erase(tasks[i]);
+        }
+        pool.recycle(tasks[i]);
+    }
+    assert(evens.size() == 9 && !evens.contains(tasks[1]));
+    std::vector<Task*> out;
+    while (!heap.empty()) {
+        out.push_back(heap.pop());
+    }
+    assert(out.size() == 16);
+    for (size_t i = 1; i < out.size(); ++i) {
+        assert(!(*out[i - 1] < *out[i]));
+    }
+    while (!evens.empty()) {
+        Task* t = evens.pop();
+        assert(evens.empty() || !(*t < *evens.front()));
+    }
+    Task* reused = pool.acquire();
+    assert(reused == tasks[11] && reused->task_id == 0);  // reset to Task{}
+    assert(pool.getNumChunks() == 5);
+
+    // ids found after others in their probe runs were erased
+    IdIndex<Task> index;
+    for (int i = 0; i < 1000; ++i) {
+        index.insert(i, tasks[i % 20]);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        index.erase(i);
+    }
+    index.erase(5000);  // not there
+    assert(index.size() == 666);
+    for (int i = 0; i < 1000; ++i) {
+        assert(index.find(i) == (i % 3 ? tasks[i % 20] : nullptr));
+    }
+    std::cout << "Task slots were recycled and the heap kept its order"
+              << std::endl;
+}
+
+int main() {
+    testSingleAndRepeated();
+    testTaskGraph();
+    testFutures();
+    testMetrics();
+    testSlack();
+    testPersistence();
+    testStrands();
+    testForkJoin();
+    testEpoll();
+    testAdmissionControl();
+    testSharded();
+    testCancellation();
+    testRecurrenceRules();
+    testRateLimit();
+    testTaskSlab();
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+/*
+    A token bucket for rate-limited task classes (e.g. outbound orders, which
+   an exchange allows at most N per second of). The bucket holds up to burst
+   tokens and gains rate tokens per second; running a task takes one token.
+
+   Instead of a task sleeping until it may send (which blocks whatever thread
+   runs it), the event loop asks the bucket before dispatching the task. If
+   the bucket is empty, the task reserves the next token that has not been
+   reserved yet and goes back in the queue with its start time set to the
+   moment that token arrives. Tasks deferred together thus get one token time
+   each, and each costs one heap push and runs on its token without asking
+   again; the loop sleeps until then like for any other timer.
+
+   The bucket is only used by the event loop under q_mutex, so it needs no
+   synchronization of its own.
+*/
+
+#ifndef TOKEN_BUCKET_H_
+#define TOKEN_BUCKET_H_
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+struct RateLimit {
+    double per_second{0};  // sustained rate (> 0)
+    double burst{1};       // tokens available at once (>= 1)
+};
+
+class TokenBucket {
+   public:
+    // Throws std::invalid_argument for a limit that would never (or only
+    // once) let a task run
+    explicit TokenBucket(RateLimit l) : limit(l), tokens(l.burst) {
+        if (!(l.per_second > 0) || !(l.burst >= 1)) {
+            throw std::invalid_argument(
+                "a rate limit needs per_second > 0 and burst >= 1");
+        }
+    }
+
+    // Takes a token if there is one
+    bool tryTake(std::chrono::system_clock::time_point now) {
+        refill(now);
+        if (tokens < 1) {
+            return false;
+        }
+        tokens -= 1;
+        return true;
+    }
+
+    // Takes the next token even if it has not arrived yet and returns when
+    // it does. tokens goes below 0 for those owed, so the next reservation
+    // comes 1 / per_second after this one.
+    std::chrono::system_clock::time_point reserve(
+        std::chrono::system_clock::time_point now) {
+        refill(now);
+        tokens -= 1;
+        if (tokens >= 0) {
+            return now;
+        }
+        auto wait = std::chrono::duration<double>(-tokens / limit.per_second);
+        return now + std::chrono::ceil<std::chrono::system_clock::duration>(
+                         wait);
+    }
+
+   private:
+    void refill(std::chrono::system_clock::time_point now) {
+        if (now > last_refill) {
+            std::chrono::duration<double> elapsed = now - last_refill;
+            tokens = std::min(limit.burst,
+                              tokens + elapsed.count() * limit.per_second);
+            last_refill = now;
+        }
+    }
+
+    RateLimit limit;
+    double tokens;
+    std::chrono::system_clock::time_point last_refill{};
+};
+
+#endif  // TOKEN_BUCKET_H_
@@ -0,0 +1,184 @@
+/*
+    A fixed-size pool of worker threads that execute jobs handed to them by the
+   task scheduler's event loop. The event loop only decides *when* something
+   should run; the pool decides *where*. Keeping the two apart means a long
+   running task no longer delays every other task in the queue.
+
+   Jobs are kept in a single FIFO protected by a mutex, and idle workers sleep
+   on a condition variable (same pattern as the event loop itself). On
+   destruction, the pool finishes every job that has been submitted so far,
+   including jobs submitted by other jobs, before joining the threads.
+
+   A job that is already running can also fan out (see fork_join.h): it spawns
+   child jobs onto its worker's own Chase-Lev deque instead of the FIFO, so
+   spawning takes no lock. The worker later pops its children back in LIFO
+   order while idle workers steal the oldest ones, and only once there is
+   nothing left to steal do workers go back to the FIFO and eventually sleep.
+   Children are always finished before their parent job returns, so the FIFO
+   keeps its meaning for the jobs the event loop submits.
+*/
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "chase_lev_deque.h"
+
+// A child job on a worker's deque. It is owned by whoever spawned it (often on
+// the stack), who waits for pending to drop before the job goes away. A plain
+// function pointer rather than a std::function, so spawning never allocates.
+struct StealableJob {
+    void (*fn)(void*);
+    void* arg;
+    std::atomic<int>* pending;
+
+    template <typename F>
+    static StealableJob make(F& f, std::atomic<int>* pending) {
+        return {[](void* arg) { (*static_cast<F*>(arg))(); }, &f, pending};
+    }
+
+    void execute() {
+        fn(arg);
+        pending->fetch_sub(1, std::memory_order_release);  // last use of *this
+    }
+};
+
+class WorkerPool {
+   public:
+    explicit WorkerPool(size_t num_workers) {
+        deques.reserve(num_workers);
+        for (size_t i = 0; i < num_workers; ++i) {
+            deques.push_back(std::make_unique<ChaseLevDeque<StealableJob>>());
+        }
+        workers.reserve(num_workers);
+        for (size_t i = 0; i < num_workers; ++i) {
+            workers.emplace_back(&WorkerPool::runWorker, this, i);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::scoped_lock lck(jobs_mutex);
+            stopping = true;
+        }
+        jobs_cvar.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool& other) = delete;
+    WorkerPool& operator=(const WorkerPool& other) = delete;
+
+    // Safe to call from any thread, including from inside a running job
+    void submit(std::function<void()> job) {
+        {
+            std::scoped_lock lck(jobs_mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobs_cvar.notify_one();  // notify after unlocking to avoid a hurry-up-and-wait
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // The pool the calling thread works for, or nullptr if it is not a worker
+    static WorkerPool* getCurrent() { return current_pool; }
+
+    // Only from one of this pool's workers (see getCurrent). The job must stay
+    // alive until its pending counter has been decremented.
+    void spawn(StealableJob* job) {
+        deques[current_idx]->push(job);
+        // pairs with the fence in runWorker: either the idle worker sees our
+        // job before it sleeps, or we see it idle and wake it up
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (num_idle.load(std::memory_order_relaxed) > 0) {
+            // once we hold the lock, the idle worker is waiting, not checking
+            { std::scoped_lock lck(jobs_mutex); }
+            jobs_cvar.notify_one();
+        }
+    }
+
+    // Only from one of this pool's workers. Runs our own children, or steals
+    // other workers' while ours are being run elsewhere, until pending is 0.
+    void helpUntilDone(const std::atomic<int>& pending) {
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!runSpawnedJob()) {
+                std::this_thread::yield();  // our children are all stolen
+            }
+        }
+    }
+
+   private:
+    // Which pool and deque the calling thread works on
+    static inline thread_local WorkerPool* current_pool = nullptr;
+    static inline thread_local size_t current_idx = 0;
+
+    // Own deque first (LIFO), then steal round-robin from the others (FIFO)
+    bool runSpawnedJob() {
+        StealableJob* job = deques[current_idx]->pop();
+        for (size_t i = 1; !job && i < deques.size(); ++i) {
+            job = deques[(current_idx + i) % deques.size()]->steal();
+        }
+        if (!job) {
+            return false;
+        }
+        job->execute();
+        return true;
+    }
+
+    bool getHasSpawnedJobs() const {
+        for (const auto& d : deques) {
+            if (!d->getIsEmpty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void runWorker(size_t idx) {
+        current_pool = this;
+        current_idx = idx;
+        std::unique_lock lck(jobs_mutex, std::defer_lock);
+        while (true) {
+            if (runSpawnedJob()) {
+                continue;
+            }
+            lck.lock();
+            num_idle.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            jobs_cvar.wait(lck, [&]() {
+                return stopping || !jobs.empty() || getHasSpawnedJobs();
+            });
+            num_idle.fetch_sub(1, std::memory_order_relaxed);
+            if (!jobs.empty()) {
+                auto job = std::move(jobs.front());
+                jobs.pop_front();
+                lck.unlock();
+                job();  // run while unlocked
+                continue;
+            }
+            lck.unlock();
+            if (!getHasSpawnedJobs()) {  // only possible if stopping
+                return;
+            }
+        }
+    }
+
+    std::deque<std::function<void()>> jobs;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cvar;
+    bool stopping = false;
+    std::atomic<size_t> num_idle{0};
+    std::vector<std::unique_ptr<ChaseLevDeque<StealableJob>>> deques;
+    std::vector<std::thread> workers;
+};
+
+#endif  // WORKER_POOL_H_